@@ -0,0 +1,283 @@
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dirtree.h"
+
+/* a directory that is being cloned */
+struct dtdir {
+	struct dtdir *next;	/* next directory in the work queue */
+	char *path;	/* path relative to the source and destination */
+};
+
+/* shared state of all workers */
+struct dtstate {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	struct dtdir *queue;	/* directories that are not cloned yet */
+	int rootfd;
+	const char *src;	/* source tree, relative to rootfd */
+	const char *dst;	/* destination tree, relative to rootfd */
+	int pending;	/* directories queued or being cloned */
+	int error;	/* set if anything could not be cloned */
+};
+
+static void
+lock(struct dtstate *st)
+{
+	int r;
+
+	if ((r = pthread_mutex_lock(&st->mtx)) != 0)
+		errc(1, r, "%s: pthread_mutex_lock", __func__);
+}
+
+static void
+unlock(struct dtstate *st)
+{
+	int r;
+
+	if ((r = pthread_mutex_unlock(&st->mtx)) != 0)
+		errc(1, r, "%s: pthread_mutex_unlock", __func__);
+}
+
+static void
+seterror(struct dtstate *st)
+{
+	lock(st);
+	st->error = 1;
+	unlock(st);
+}
+
+/*
+ * Queue a directory so that it will be cloned by one of the workers.
+ */
+static void
+push(struct dtstate *st, struct dtdir *d)
+{
+	int r;
+
+	lock(st);
+	d->next = st->queue;
+	st->queue = d;
+	st->pending++;
+	if ((r = pthread_cond_signal(&st->cond)) != 0)
+		errc(1, r, "%s: pthread_cond_signal", __func__);
+	unlock(st);
+}
+
+/*
+ * Mark a directory as cloned. Wake up all workers if it was the last one so
+ * that they can exit.
+ */
+static void
+done(struct dtstate *st)
+{
+	int r;
+
+	lock(st);
+	if (--st->pending == 0)
+		if ((r = pthread_cond_broadcast(&st->cond)) != 0)
+			errc(1, r, "%s: pthread_cond_broadcast", __func__);
+	unlock(st);
+}
+
+/*
+ * Create a directory in the destination with the same owner as in the source.
+ * The mode is always 0700 so that the owner can write into it during the sync,
+ * the final mode and times are left to rsync.
+ *
+ * Return 0 on success, or -1 on error with errno set.
+ */
+static int
+mkclonedir(int dstfd, const char *name, const struct stat *sb)
+{
+	if (mkdirat(dstfd, name, S_IRWXU) == -1)
+		return -1;
+	return fchownat(dstfd, name, sb->st_uid, sb->st_gid, 0);
+}
+
+/*
+ * Clone one directory: create and queue all subdirectories in the destination.
+ * Anything else is skipped.
+ */
+static void
+clonedir(struct dtstate *st, struct dtdir *d)
+{
+	struct dirent *de;
+	struct dtdir *sub;
+	struct stat sb;
+	DIR *dir;
+	char *path;
+	int fd, dstfd;
+
+	if (asprintf(&path, "%s/%s", st->src, d->path) == -1)
+		err(1, "%s: asprintf", __func__);
+	fd = openat(st->rootfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		O_CLOEXEC);
+	free(path);
+	path = NULL;
+
+	if (fd == -1) {
+		warn("%s/%s", st->src, d->path);
+		seterror(st);
+		return;
+	}
+
+	if ((dir = fdopendir(fd)) == NULL)
+		err(1, "%s: fdopendir %s", __func__, d->path);
+
+	if (asprintf(&path, "%s/%s", st->dst, d->path) == -1)
+		err(1, "%s: asprintf", __func__);
+	dstfd = openat(st->rootfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		O_CLOEXEC);
+	free(path);
+	path = NULL;
+
+	if (dstfd == -1) {
+		warn("%s/%s", st->dst, d->path);
+		seterror(st);
+		if (closedir(dir) == -1)
+			err(1, "%s: closedir", __func__);
+		return;
+	}
+
+	for (;;) {
+		errno = 0;
+		if ((de = readdir(dir)) == NULL)
+			break;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+			continue;
+
+		if (fstatat(dirfd(dir), de->d_name, &sb, AT_SYMLINK_NOFOLLOW)
+		    == -1) {
+			warn("%s/%s/%s", st->src, d->path, de->d_name);
+			seterror(st);
+			continue;
+		}
+
+		if (!S_ISDIR(sb.st_mode))
+			continue;
+
+		if (mkclonedir(dstfd, de->d_name, &sb) == -1) {
+			warn("%s/%s/%s", st->dst, d->path, de->d_name);
+			seterror(st);
+			continue;
+		}
+
+		if ((sub = malloc(sizeof(*sub))) == NULL)
+			err(1, "%s: malloc", __func__);
+		if (asprintf(&sub->path, "%s/%s", d->path, de->d_name) == -1)
+			err(1, "%s: asprintf", __func__);
+
+		push(st, sub);
+	}
+
+	if (errno != 0) {
+		warn("%s/%s: readdir", st->src, d->path);
+		seterror(st);
+	}
+
+	if (close(dstfd) == -1)
+		err(1, "%s: close", __func__);
+	if (closedir(dir) == -1)
+		err(1, "%s: closedir", __func__);
+}
+
+static void *
+worker(void *arg)
+{
+	struct dtstate *st = arg;
+	struct dtdir *d;
+	int r;
+
+	for (;;) {
+		lock(st);
+		while (st->queue == NULL && st->pending > 0)
+			if ((r = pthread_cond_wait(&st->cond, &st->mtx)) != 0)
+				errc(1, r, "%s: pthread_cond_wait", __func__);
+
+		if ((d = st->queue) == NULL) {
+			unlock(st);
+			return NULL;
+		}
+
+		st->queue = d->next;
+		unlock(st);
+
+		clonedir(st, d);
+		free(d->path);
+		free(d);
+		done(st);
+	}
+}
+
+/*
+ * Clone the directory hierarchy of "src" into the existing directory "dst",
+ * both relative to "rootfd", using "nthreads" threads. Directories are created
+ * with the mode and owner of the source, everything else is left out. Nothing
+ * is shared with the source, so the destination can be changed without
+ * changing the source. Symlinks are not followed.
+ *
+ * Return 0 on success, or -1 if anything could not be cloned. A warning is
+ * printed for every failure.
+ */
+int
+dirtree(int rootfd, const char *src, const char *dst, int nthreads)
+{
+	struct dtstate st;
+	struct dtdir *d;
+	pthread_t *tv;
+	int i, r;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	memset(&st, 0, sizeof(st));
+	st.rootfd = rootfd;
+	st.src = src;
+	st.dst = dst;
+
+	if ((r = pthread_mutex_init(&st.mtx, NULL)) != 0)
+		errc(1, r, "%s: pthread_mutex_init", __func__);
+	if ((r = pthread_cond_init(&st.cond, NULL)) != 0)
+		errc(1, r, "%s: pthread_cond_init", __func__);
+
+	if ((d = malloc(sizeof(*d))) == NULL)
+		err(1, "%s: malloc", __func__);
+	if ((d->path = strdup(".")) == NULL)
+		err(1, "%s: strdup", __func__);
+	push(&st, d);
+
+	if ((tv = reallocarray(NULL, nthreads, sizeof(*tv))) == NULL)
+		err(1, "%s: reallocarray", __func__);
+
+	for (i = 0; i < nthreads; i++)
+		if ((r = pthread_create(&tv[i], NULL, worker, &st)) != 0)
+			errc(1, r, "%s: pthread_create", __func__);
+
+	for (i = 0; i < nthreads; i++)
+		if ((r = pthread_join(tv[i], NULL)) != 0)
+			errc(1, r, "%s: pthread_join", __func__);
+
+	free(tv);
+
+	if ((r = pthread_cond_destroy(&st.cond)) != 0)
+		errc(1, r, "%s: pthread_cond_destroy", __func__);
+	if ((r = pthread_mutex_destroy(&st.mtx)) != 0)
+		errc(1, r, "%s: pthread_mutex_destroy", __func__);
+
+	return st.error ? -1 : 0;
+}
@@ -0,0 +1,6 @@
+#ifndef DIRTREE_H
+#define DIRTREE_H
+
+int dirtree(int, const char *, const char *, int);
+
+#endif
@@ -10,9 +10,18 @@
 #include "util.h"
 #include "scfg.h"
 
+#define RSYNCVALOPTS "BMTef"	/* Short rsync options that take a value. */
+
 struct endpoint **epv = NULL;
 
 extern int forceopt;
+extern int maxjobs;
+extern int forkwindow;
+extern int devjobs;
+extern int hostjobs;
+extern enum schedule schedule;
+extern int windowstart;
+extern int windowend;
 
 /* default settings */
 struct tmpkv defset[] = {
@@ -24,6 +33,26 @@ struct tmpkv defset[] = {
 	{ "daily", "0", NULL },
 	{ "weekly", "0", NULL },
 	{ "monthly", "0", NULL },
+	{ "jobs", "1", NULL },
+	{ "forkwindow", "0", NULL },
+	{ "devjobs", "0", NULL },
+	{ "hostjobs", "0", NULL },
+	{ "schedule", "config", NULL },
+	{ "maxruntime", "0", NULL },
+	{ "rmthreads", "1", NULL },
+	{ "asyncpurge", "no", NULL },
+	{ "rmrate", "0", NULL },
+	{ "rmload", "0", NULL },
+	{ "layout", "rename", NULL },
+	{ "resume", "no", NULL },
+	{ "prestage", "no", NULL },
+	{ "prestagethreads", "1", NULL },
+	{ "linkdests", "1", NULL },
+	{ "sshmux", "no", NULL },
+	{ "compress", "zlib", NULL },
+	{ "compresslevel", "0", NULL },
+	{ "wholefile", "no", NULL },
+	{ "blocksize", "0", NULL },
 };
 
 /* global settings */
@@ -43,6 +72,28 @@ struct tmpkv gset[] = {
 	{ "hostname", NULL, NULL },
 	{ "rpath", NULL, NULL },
 	{ "exec", NULL, NULL },
+	{ "jobs", NULL, NULL },
+	{ "forkwindow", NULL, NULL },
+	{ "devjobs", NULL, NULL },
+	{ "hostjobs", NULL, NULL },
+	{ "schedule", NULL, NULL },
+	{ "window", NULL, NULL },
+	{ "maxruntime", NULL, NULL },
+	{ "rmthreads", NULL, NULL },
+	{ "asyncpurge", NULL, NULL },
+	{ "rmrate", NULL, NULL },
+	{ "rmload", NULL, NULL },
+	{ "layout", NULL, NULL },
+	{ "resume", NULL, NULL },
+	{ "prestage", NULL, NULL },
+	{ "prestagethreads", NULL, NULL },
+	{ "linkdests", NULL, NULL },
+	{ "sshmux", NULL, NULL },
+	{ "shards", NULL, NULL },
+	{ "compress", NULL, NULL },
+	{ "compresslevel", NULL, NULL },
+	{ "wholefile", NULL, NULL },
+	{ "blocksize", NULL, NULL },
 };
 
 /* per-endpoint setting */
@@ -62,6 +113,22 @@ struct tmpkv tmpepset[] = {
 	{ "hostname", NULL, NULL },
 	{ "rpath", NULL, NULL },
 	{ "exec", NULL, NULL },
+	{ "maxruntime", NULL, NULL },
+	{ "rmthreads", NULL, NULL },
+	{ "asyncpurge", NULL, NULL },
+	{ "rmrate", NULL, NULL },
+	{ "rmload", NULL, NULL },
+	{ "layout", NULL, NULL },
+	{ "resume", NULL, NULL },
+	{ "prestage", NULL, NULL },
+	{ "prestagethreads", NULL, NULL },
+	{ "linkdests", NULL, NULL },
+	{ "sshmux", NULL, NULL },
+	{ "shards", NULL, NULL },
+	{ "compress", NULL, NULL },
+	{ "compresslevel", NULL, NULL },
+	{ "wholefile", NULL, NULL },
+	{ "blocksize", NULL, NULL },
 	{ "backup", NULL, NULL },
 };
 
@@ -75,6 +142,8 @@ int **getmnsetting(char *);
 int getbsetting(char *, int *);
 int getnsetting(char *, int *);
 int getunsetting(char *, unsigned int *);
+int hasrsyncarg(char **, int, const char *);
+int hasfilter(char **);
 int haskey(struct tmpkv *, size_t, const char *);
 char *getkey(struct tmpkv *, size_t, const char *);
 int parsehoststr(const char *, char **, char **, char **);
@@ -160,10 +229,17 @@ createendpoint(struct scfgentry *ce)
 	struct endpoint **epp, *ep;
 	struct snapinterval **siv;
 	struct scfgiteropts iteropts;
-	int e, issubdir, createroot;
+	int e, issubdir, createroot, rmthreads, asyncpurge, rmrate, rmload;
+	int resume, prestage, prestagethreads, linkdests, sshmux, compresslevel;
+	int blocksize;
+	time_t maxruntime;
+	enum layout layout;
+	enum compress compress;
+	enum wholefile wholefile;
 	uid_t uid;
 	gid_t gid, shared;
-	char **root, *hoststr, *ruser, *hostname, *rpath, *tmp, *backupid;
+	char **root, **cpp, **cpp2, *hoststr, *ruser, *hostname, *rpath, *tmp;
+	char *backupid;
 	const char *key;
 	int **rsyncexit;
 
@@ -304,6 +380,107 @@ createendpoint(struct scfgentry *ce)
 		e = 1;
 	}
 
+	if (parseduration(getsetting("maxruntime"), &maxruntime) == -1) {
+		warnx("maxruntime is not a valid duration: \"%s\"",
+			getsetting("maxruntime"));
+		e = 1;
+	}
+
+	if (getnsetting("rmthreads", &rmthreads) == -1 || rmthreads < 1) {
+		warnx("rmthreads must be a positive number: \"%s\"",
+			getsetting("rmthreads"));
+		e = 1;
+	}
+
+	if (getbsetting("asyncpurge", &asyncpurge) == -1) {
+		warnx("asyncpurge is not set to either \"yes\" or \"no\"");
+		e = 1;
+	}
+
+	if (getnsetting("linkdests", &linkdests) == -1 || linkdests < 1 ||
+	    linkdests > MAXLINKDESTS) {
+		warnx("linkdests must be a number from 1 to %d: \"%s\"",
+			MAXLINKDESTS, getsetting("linkdests"));
+		e = 1;
+	}
+
+	if (getnsetting("rmrate", &rmrate) == -1 || rmrate < 0) {
+		warnx("rmrate must be a number: \"%s\"", getsetting("rmrate"));
+		e = 1;
+	}
+
+	if (getnsetting("rmload", &rmload) == -1 || rmload < 0) {
+		warnx("rmload must be a number: \"%s\"", getsetting("rmload"));
+		e = 1;
+	}
+
+	if (getbsetting("resume", &resume) == -1) {
+		warnx("resume is not set to either \"yes\" or \"no\"");
+		e = 1;
+	}
+
+	if (getbsetting("prestage", &prestage) == -1) {
+		warnx("prestage is not set to either \"yes\" or \"no\"");
+		e = 1;
+	}
+
+	if (getnsetting("prestagethreads", &prestagethreads) == -1 ||
+	    prestagethreads < 1) {
+		warnx("prestagethreads must be a positive number: \"%s\"",
+			getsetting("prestagethreads"));
+		e = 1;
+	}
+
+	if (getbsetting("sshmux", &sshmux) == -1) {
+		warnx("sshmux is not set to either \"yes\" or \"no\"");
+		e = 1;
+	}
+
+	layout = LAYOUTRENAME;
+	if (strcmp(getsetting("layout"), "fixed") == 0) {
+		layout = LAYOUTFIXED;
+	} else if (strcmp(getsetting("layout"), "rename") != 0) {
+		warnx("layout must be \"rename\" or \"fixed\": \"%s\"",
+			getsetting("layout"));
+		e = 1;
+	}
+
+	compress = COMPRESSZLIB;
+	if (strcmp(getsetting("compress"), "none") == 0) {
+		compress = COMPRESSNONE;
+	} else if (strcmp(getsetting("compress"), "auto") == 0) {
+		compress = COMPRESSAUTO;
+	} else if (strcmp(getsetting("compress"), "zlib") != 0) {
+		warnx("compress must be \"none\", \"zlib\" or \"auto\": "
+			"\"%s\"", getsetting("compress"));
+		e = 1;
+	}
+
+	if (getnsetting("compresslevel", &compresslevel) == -1 ||
+	    compresslevel < 0 || compresslevel > MAXCOMPRESSLEVEL) {
+		warnx("compresslevel must be a number from 0 to %d: \"%s\"",
+			MAXCOMPRESSLEVEL, getsetting("compresslevel"));
+		e = 1;
+	}
+
+	wholefile = WHOLEFILENO;
+	if (strcmp(getsetting("wholefile"), "yes") == 0) {
+		wholefile = WHOLEFILEYES;
+	} else if (strcmp(getsetting("wholefile"), "auto") == 0) {
+		wholefile = WHOLEFILEAUTO;
+	} else if (strcmp(getsetting("wholefile"), "no") != 0) {
+		warnx("wholefile must be \"yes\", \"no\" or \"auto\": \"%s\"",
+			getsetting("wholefile"));
+		e = 1;
+	}
+
+	if (getnsetting("blocksize", &blocksize) == -1 || blocksize < 0 ||
+	    blocksize > MAXBLOCKSIZE) {
+		warnx("blocksize must be a number from 0 to %d: \"%s\"",
+			MAXBLOCKSIZE, getsetting("blocksize"));
+		e = 1;
+	}
+
 	/*
 	 * Resolve shared group id (precedence of names over ids is
 	 * based on chown(1) and POSIX).
@@ -395,6 +572,37 @@ createendpoint(struct scfgentry *ce)
 		}
 	}
 
+	/*
+	 * Shards are synced into the same directory as the rest of the
+	 * location, so only accept distinct subdirs directly below rpath.
+	 */
+	for (cpp = getmsetting("shards"); cpp && *cpp; cpp++) {
+		if (**cpp == '\0' || strchr(*cpp, '/') != NULL ||
+		    strcmp(*cpp, ".") == 0 || strcmp(*cpp, "..") == 0) {
+			warnx("shard must be the name of a directory in rpath: "
+				"\"%s\"", *cpp);
+			e = 1;
+			continue;
+		}
+
+		for (cpp2 = getmsetting("shards"); cpp2 < cpp; cpp2++)
+			if (strcmp(*cpp2, *cpp) == 0)
+				break;
+
+		if (cpp2 < cpp) {
+			warnx("shard is configured more than once: \"%s\"",
+				*cpp);
+			e = 1;
+		}
+	}
+
+	/* The main pass excludes the shards, so it would delete them. */
+	if (getmsetting("shards") != NULL &&
+	    hasrsyncarg(getmsetting("rsyncargs"), 0, "delete-excluded")) {
+		warnx("shards can not be combined with --delete-excluded");
+		e = 1;
+	}
+
 	rsyncexit = NULL;
 	if (getmsetting("rsyncexit") != NULL) {
 		if ((rsyncexit = getmnsetting("rsyncexit")) == NULL) {
@@ -444,6 +652,45 @@ createendpoint(struct scfgentry *ce)
 		getmsetting("rsyncargs"), rsyncexit, getsetting("exec"));
 	clrintv(&rsyncexit);
 
+	/* --stats is always passed, but -q leaves out the output. */
+	if (hasrsyncarg(getmsetting("rsyncargs"), 'q', "quiet"))
+		warnx("%s: rsyncargs contains -q, no transfer statistics are "
+			"collected", snaps_endpoint_id(ep));
+
+	/* An own remote shell would bypass the control socket. */
+	if (sshmux && hasrsyncarg(getmsetting("rsyncargs"), 'e', "rsh")) {
+		warnx("%s: rsyncargs contains -e, sshmux is disabled",
+			snaps_endpoint_id(ep));
+		sshmux = 0;
+	}
+
+	/*
+	 * Prestaged directories that match an exclude would be protected from
+	 * --delete and stay in the new snapshot.
+	 */
+	if (prestage && hasfilter(getmsetting("rsyncargs"))) {
+		warnx("%s: rsyncargs contains filter rules, prestage is "
+			"disabled", snaps_endpoint_id(ep));
+		prestage = 0;
+	}
+
+	ep->maxruntime = maxruntime;
+	ep->rmthreads = rmthreads;
+	ep->asyncpurge = asyncpurge;
+	ep->rmrate = rmrate;
+	ep->rmload = rmload;
+	ep->layout = layout;
+	ep->resume = resume;
+	ep->prestage = prestage;
+	ep->prestagethreads = prestagethreads;
+	ep->linkdests = linkdests;
+	ep->sshmux = sshmux;
+	ep->shards = dupstrv(getmsetting("shards"));
+	ep->compress = compress;
+	ep->compresslevel = compresslevel;
+	ep->wholefile = wholefile;
+	ep->blocksize = blocksize;
+
 	/* Finally, add the new endpoint. */
 	epv = snaps_add_endpoint(epv, ep);
 
@@ -696,6 +943,63 @@ getunsetting(char *key, unsigned int *res)
 	return 0;
 }
 
+/*
+ * Check whether the extra rsync arguments "args" contain the short option
+ * "sopt" or the long option "lopt". Short options may be grouped, an option
+ * that takes a value ends the group. Pass 0 for an option without a short
+ * form and NULL for an option without a long form.
+ *
+ * Returns 1 if the option is found, 0 otherwise.
+ */
+int
+hasrsyncarg(char **args, int sopt, const char *lopt)
+{
+	const char *cp;
+	size_t len;
+
+	len = lopt != NULL ? strlen(lopt) : 0;
+
+	for (; args && *args; args++) {
+		if (strncmp(*args, "--", 2) == 0) {
+			cp = *args + 2;
+			if (lopt != NULL && strncmp(cp, lopt, len) == 0 &&
+			    (cp[len] == '\0' || cp[len] == '='))
+				return 1;
+			continue;
+		}
+
+		if (**args != '-')
+			continue;
+
+		for (cp = *args + 1; *cp != '\0'; cp++) {
+			if (sopt != 0 && *cp == sopt)
+				return 1;
+			if (strchr(RSYNCVALOPTS, *cp) != NULL)
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Check whether the extra rsync arguments "args" contain any option that adds
+ * a filter rule, like an exclude.
+ *
+ * Returns 1 if such an option is found, 0 otherwise.
+ */
+int
+hasfilter(char **args)
+{
+	return hasrsyncarg(args, 'f', "filter") ||
+	    hasrsyncarg(args, 'F', NULL) ||
+	    hasrsyncarg(args, 'C', "cvs-exclude") ||
+	    hasrsyncarg(args, 0, "exclude") ||
+	    hasrsyncarg(args, 0, "exclude-from") ||
+	    hasrsyncarg(args, 0, "include") ||
+	    hasrsyncarg(args, 0, "include-from");
+}
+
 /*
  * Determine the number of days in the month the given time lies in.
  *
@@ -976,6 +1280,10 @@ parseconfig(int cfgd)
 	extern int yyparse(void);
 	extern int yyd;
 	struct scfgiteropts iteropts;
+	char **window;
+
+	/* The caller owns the endpoints of any previous config. */
+	epv = NULL;
 
 	yyd = cfgd;
 
@@ -993,6 +1301,51 @@ parseconfig(int cfgd)
 	if (scfg_foreach(&iteropts, setgset) != 1)
 		errx(1, "%s: not all global settings could be set", __func__);
 
+	/* Settings that only apply to the master. */
+	if (getnsetting("jobs", &maxjobs) == -1 || maxjobs < 1)
+		errx(1, "jobs must be a positive number: \"%s\"",
+			getsetting("jobs"));
+	if (getnsetting("forkwindow", &forkwindow) == -1 || forkwindow < 0)
+		errx(1, "forkwindow must be a number: \"%s\"",
+			getsetting("forkwindow"));
+	if (forkwindow > 0 && forkwindow < maxjobs)
+		errx(1, "forkwindow must be 0 or at least jobs (%d): \"%s\"",
+			maxjobs, getsetting("forkwindow"));
+	/*
+	 * devjobs is set globally but applies per file system, duejobs()
+	 * records the device of each location and runjobs() limits each
+	 * device separately.
+	 */
+	if (getnsetting("devjobs", &devjobs) == -1 || devjobs < 0)
+		errx(1, "devjobs must be a number: \"%s\"",
+			getsetting("devjobs"));
+	if (getnsetting("hostjobs", &hostjobs) == -1 || hostjobs < 0)
+		errx(1, "hostjobs must be a number: \"%s\"",
+			getsetting("hostjobs"));
+	if (strcmp(getsetting("schedule"), "config") == 0)
+		schedule = SCHEDCONFIG;
+	else if (strcmp(getsetting("schedule"), "overdue") == 0)
+		schedule = SCHEDOVERDUE;
+	else if (strcmp(getsetting("schedule"), "longest") == 0)
+		schedule = SCHEDLONGEST;
+	else
+		errx(1, "schedule must be \"config\", \"overdue\" or "
+			"\"longest\": \"%s\"", getsetting("schedule"));
+	windowstart = windowend = -1;
+	if ((window = getmsetting("window")) != NULL) {
+		if (window[1] != NULL && window[2] != NULL)
+			errx(1, "window takes at most a start and an end time");
+
+		if (window[1] != NULL &&
+		    parsetimeofday(window[0], &windowstart) == -1)
+			errx(1, "window must be a time of day in the format "
+				"HH:MM: \"%s\"", window[0]);
+
+		if (parsetimeofday(window[window[1] != NULL], &windowend) == -1)
+			errx(1, "window must be a time of day in the format "
+				"HH:MM: \"%s\"", window[window[1] != NULL]);
+	}
+
 	/* Second pass: create endpoints. */
 	iteropts.key = "backup";
 	if (scfg_foreach(&iteropts, createendpoint) != 1)
@@ -0,0 +1,434 @@
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rmtree.h"
+
+#define MAXLOADPAUSE 3600	/* Seconds removal may be paused in total. */
+
+/* a directory that is being removed */
+struct rmdir {
+	struct rmdir *parent;	/* NULL if this is the top of the tree */
+	struct rmdir *next;	/* next directory in the work queue */
+	char *path;	/* path relative to rootfd, for messages */
+	const char *name;	/* name in the parent, or path at the top */
+	int fd;	/* open until removed, -1 if it could not be opened */
+	int refs;	/* subdirs not removed yet, plus one until it is read */
+};
+
+/* an entry of a directory that is being removed */
+struct dent {
+	ino_t ino;
+	unsigned char type;
+	char *name;
+};
+
+/* shared state of all workers */
+struct rmstate {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_cond_t pausecond;	/* signalled when a pause ends */
+	struct rmdir *queue;	/* directories that are not read yet */
+	int rootfd;
+	int done;	/* set when the top of the tree is removed */
+	int error;	/* set if anything could not be removed */
+	int rate;	/* maximum number of removals per second, 0 is unlimited */
+	int maxload;	/* pause while the load average exceeds it, 0 is never */
+	struct timespec interval;	/* time between two removals */
+	struct timespec next;	/* time at which the next removal may start */
+	time_t loadcheck;	/* time of the last load average check */
+	int pausing;	/* set while a worker waits for the load to drop */
+	time_t paused;	/* seconds removal was paused in total */
+};
+
+static void
+lock(struct rmstate *st)
+{
+	int r;
+
+	if ((r = pthread_mutex_lock(&st->mtx)) != 0)
+		errc(1, r, "%s: pthread_mutex_lock", __func__);
+}
+
+static void
+unlock(struct rmstate *st)
+{
+	int r;
+
+	if ((r = pthread_mutex_unlock(&st->mtx)) != 0)
+		errc(1, r, "%s: pthread_mutex_unlock", __func__);
+}
+
+static void
+seterror(struct rmstate *st)
+{
+	lock(st);
+	st->error = 1;
+	unlock(st);
+}
+
+/*
+ * Wait until the next removal may start. Each removal is given a time slot so
+ * that all workers together do not exceed the configured rate. Once every
+ * second the load average is checked, while it is too high the worker that
+ * checked it sleeps and all other workers wait for it. Once removal has been
+ * paused for MAXLOADPAUSE seconds in total the load is no longer checked, so
+ * that a location is not held up forever.
+ */
+static void
+throttle(struct rmstate *st)
+{
+	struct timespec now, slot;
+	double load;
+	int r;
+
+	if (st->rate == 0 && st->maxload == 0)
+		return;
+
+	lock(st);
+
+	while (st->pausing)
+		if ((r = pthread_cond_wait(&st->pausecond, &st->mtx)) != 0)
+			errc(1, r, "%s: pthread_cond_wait", __func__);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "%s: clock_gettime", __func__);
+
+	if (st->maxload > 0 && st->paused < MAXLOADPAUSE &&
+	    now.tv_sec != st->loadcheck) {
+		st->loadcheck = now.tv_sec;
+		st->pausing = 1;
+
+		while (st->paused < MAXLOADPAUSE &&
+		    getloadavg(&load, 1) == 1 && load > st->maxload) {
+			unlock(st);
+			sleep(1);
+			lock(st);
+
+			if (++st->paused == MAXLOADPAUSE)
+				warnx("removal was paused for %d seconds, "
+					"continuing", MAXLOADPAUSE);
+		}
+
+		st->pausing = 0;
+		if ((r = pthread_cond_broadcast(&st->pausecond)) != 0)
+			errc(1, r, "%s: pthread_cond_broadcast", __func__);
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+			err(1, "%s: clock_gettime", __func__);
+	}
+
+	slot = now;
+	if (st->rate > 0) {
+		if (timespeccmp(&st->next, &now, >))
+			slot = st->next;
+		timespecadd(&slot, &st->interval, &st->next);
+	}
+
+	unlock(st);
+
+	if (timespeccmp(&slot, &now, >)) {
+		timespecsub(&slot, &now, &slot);
+		while (nanosleep(&slot, &slot) == -1)
+			if (errno != EINTR)
+				err(1, "%s: nanosleep", __func__);
+	}
+}
+
+/*
+ * Queue a directory so that it will be read by one of the workers. The queue
+ * is a stack so that the tree is walked depth-first, which keeps the number of
+ * directories that are read but not yet removed low.
+ */
+static void
+push(struct rmstate *st, struct rmdir *d)
+{
+	int r;
+
+	lock(st);
+	d->next = st->queue;
+	st->queue = d;
+	if ((r = pthread_cond_signal(&st->cond)) != 0)
+		errc(1, r, "%s: pthread_cond_signal", __func__);
+	unlock(st);
+}
+
+static int
+cmpino(const void *a, const void *b)
+{
+	const struct dent *da = a, *db = b;
+
+	if (da->ino < db->ino)
+		return -1;
+	if (da->ino > db->ino)
+		return 1;
+	return 0;
+}
+
+/*
+ * Drop a reference to a directory. If it was the last one, the directory is
+ * empty and is removed relative to its parent, after which the reference it
+ * holds on its parent is dropped.
+ */
+static void
+release(struct rmstate *st, struct rmdir *d)
+{
+	struct rmdir *p;
+	int last, r;
+
+	for (; d != NULL; d = p) {
+		lock(st);
+		last = --d->refs == 0;
+		unlock(st);
+
+		if (!last)
+			return;
+
+		if (d->fd != -1 && close(d->fd) == -1)
+			err(1, "%s: close %s", __func__, d->path);
+
+		p = d->parent;
+
+		throttle(st);
+		if (unlinkat(p != NULL ? p->fd : st->rootfd, d->name,
+		    AT_REMOVEDIR) == -1) {
+			warn("%s", d->path);
+			seterror(st);
+		}
+		free(d->path);
+		free(d);
+
+		if (p == NULL) {
+			lock(st);
+			st->done = 1;
+			if ((r = pthread_cond_broadcast(&st->cond)) != 0)
+				errc(1, r, "%s: pthread_cond_broadcast",
+					__func__);
+			unlock(st);
+		}
+	}
+}
+
+/*
+ * Open a directory relative to its parent, so that a symlink that replaced a
+ * directory anywhere up the path is never followed, then unlink all
+ * non-directories in it in inode order and queue all subdirectories. The
+ * directory stays open so that its subdirectories can be opened and removed
+ * relative to it.
+ */
+static void
+readrmdir(struct rmstate *st, struct rmdir *d)
+{
+	struct dirent *de;
+	struct dent *dv;
+	struct rmdir *sub;
+	struct stat sb;
+	size_t i, n, size;
+	DIR *dir;
+	int fd;
+
+	d->fd = openat(d->parent != NULL ? d->parent->fd : st->rootfd, d->name,
+		O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (d->fd == -1) {
+		warn("%s", d->path);
+		seterror(st);
+		return;
+	}
+
+	if ((fd = fcntl(d->fd, F_DUPFD_CLOEXEC, 0)) == -1)
+		err(1, "%s: fcntl %s", __func__, d->path);
+	if ((dir = fdopendir(fd)) == NULL)
+		err(1, "%s: fdopendir %s", __func__, d->path);
+
+	dv = NULL;
+	n = size = 0;
+
+	for (;;) {
+		errno = 0;
+		if ((de = readdir(dir)) == NULL)
+			break;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			if ((dv = reallocarray(dv, size, sizeof(*dv))) == NULL)
+				err(1, "%s: reallocarray", __func__);
+		}
+
+		dv[n].ino = de->d_ino;
+		dv[n].type = de->d_type;
+		if ((dv[n].name = strdup(de->d_name)) == NULL)
+			err(1, "%s: strdup", __func__);
+		n++;
+	}
+
+	if (errno != 0) {
+		warn("%s: readdir", d->path);
+		seterror(st);
+	}
+
+	/* Process entries in inode order for locality on disk. */
+	qsort(dv, n, sizeof(*dv), cmpino);
+
+	for (i = 0; i < n; i++) {
+		if (dv[i].type == DT_UNKNOWN) {
+			if (fstatat(dirfd(dir), dv[i].name, &sb,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+				warn("%s/%s", d->path, dv[i].name);
+				seterror(st);
+				free(dv[i].name);
+				continue;
+			}
+
+			if (S_ISDIR(sb.st_mode))
+				dv[i].type = DT_DIR;
+		}
+
+		if (dv[i].type == DT_DIR) {
+			if ((sub = malloc(sizeof(*sub))) == NULL)
+				err(1, "%s: malloc", __func__);
+			if (asprintf(&sub->path, "%s/%s", d->path,
+			    dv[i].name) == -1)
+				err(1, "%s: asprintf", __func__);
+			sub->name = sub->path + strlen(d->path) + 1;
+			sub->fd = -1;
+			sub->parent = d;
+			sub->refs = 1;
+
+			lock(st);
+			d->refs++;
+			unlock(st);
+
+			push(st, sub);
+		} else {
+			throttle(st);
+			if (unlinkat(dirfd(dir), dv[i].name, 0) == -1) {
+				warn("%s/%s", d->path, dv[i].name);
+				seterror(st);
+			}
+		}
+
+		free(dv[i].name);
+	}
+
+	free(dv);
+
+	if (closedir(dir) == -1)
+		err(1, "%s: closedir", __func__);
+}
+
+static void *
+worker(void *arg)
+{
+	struct rmstate *st = arg;
+	struct rmdir *d;
+	int r;
+
+	for (;;) {
+		lock(st);
+		while (st->queue == NULL && !st->done)
+			if ((r = pthread_cond_wait(&st->cond, &st->mtx)) != 0)
+				errc(1, r, "%s: pthread_cond_wait", __func__);
+
+		if ((d = st->queue) == NULL) {
+			unlock(st);
+			return NULL;
+		}
+
+		st->queue = d->next;
+		unlock(st);
+
+		readrmdir(st, d);
+		release(st, d);
+	}
+}
+
+/*
+ * Remove the directory "path", relative to "rootfd", and everything in it
+ * using "nthreads" threads. Each thread takes a directory from a shared queue,
+ * unlinks all files in it and queues all subdirectories. A directory is removed
+ * by the thread that removes its last subdirectory. Every directory is opened
+ * and removed relative to its parent, so symlinks are not followed, not even
+ * when a directory is replaced by one while the tree is removed.
+ *
+ * If "rate" is not 0, at most "rate" files and directories are removed per
+ * second. If "maxload" is not 0, removal is paused while the one minute load
+ * average exceeds "maxload", for at most MAXLOADPAUSE seconds in total.
+ *
+ * Return 0 on success, or -1 if anything could not be removed. A warning is
+ * printed for every failure.
+ */
+int
+rmtree(int rootfd, const char *path, int nthreads, int rate, int maxload)
+{
+	struct rmstate st;
+	struct rmdir *d;
+	pthread_t *tv;
+	int i, r;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	if ((d = malloc(sizeof(*d))) == NULL)
+		err(1, "%s: malloc", __func__);
+	if ((d->path = strdup(path)) == NULL)
+		err(1, "%s: strdup", __func__);
+	d->name = d->path;
+	d->fd = -1;
+	d->parent = NULL;
+	d->next = NULL;
+	d->refs = 1;
+
+	memset(&st, 0, sizeof(st));
+	st.rootfd = rootfd;
+	st.queue = d;
+	st.rate = rate;
+	st.maxload = maxload;
+
+	if (rate > 0) {
+		st.interval.tv_sec = 1 / rate;
+		st.interval.tv_nsec = (1000000000L / rate) % 1000000000L;
+	}
+
+	if ((r = pthread_mutex_init(&st.mtx, NULL)) != 0)
+		errc(1, r, "%s: pthread_mutex_init", __func__);
+	if ((r = pthread_cond_init(&st.cond, NULL)) != 0)
+		errc(1, r, "%s: pthread_cond_init", __func__);
+	if ((r = pthread_cond_init(&st.pausecond, NULL)) != 0)
+		errc(1, r, "%s: pthread_cond_init", __func__);
+
+	if ((tv = reallocarray(NULL, nthreads, sizeof(*tv))) == NULL)
+		err(1, "%s: reallocarray", __func__);
+
+	for (i = 0; i < nthreads; i++)
+		if ((r = pthread_create(&tv[i], NULL, worker, &st)) != 0)
+			errc(1, r, "%s: pthread_create", __func__);
+
+	for (i = 0; i < nthreads; i++)
+		if ((r = pthread_join(tv[i], NULL)) != 0)
+			errc(1, r, "%s: pthread_join", __func__);
+
+	free(tv);
+
+	if ((r = pthread_cond_destroy(&st.cond)) != 0)
+		errc(1, r, "%s: pthread_cond_destroy", __func__);
+	if ((r = pthread_cond_destroy(&st.pausecond)) != 0)
+		errc(1, r, "%s: pthread_cond_destroy", __func__);
+	if ((r = pthread_mutex_destroy(&st.mtx)) != 0)
+		errc(1, r, "%s: pthread_mutex_destroy", __func__);
+
+	return st.error ? -1 : 0;
+}
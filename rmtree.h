@@ -0,0 +1,6 @@
+#ifndef RMTREE_H
+#define RMTREE_H
+
+int rmtree(int, const char *, int, int, int);
+
+#endif
@@ -1,21 +1,685 @@
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
-#include <fts.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "dirtree.h"
+#include "rmtree.h"
 #include "rotator.h"
 
+/* in-memory index of the snapshot directories of a location */
+struct snapent {
+	const char *name;	/* interval name, SYNCDIR or DELIVAL */
+	int number;	/* number within the interval */
+	int isdir;	/* whether the entry is a directory */
+	time_t born;	/* modification time of the directory */
+	int seq;	/* number of the SNAPPREFIX directory, 0 if none */
+};
+
+static struct snapent *snapidx;
+static size_t snapidxlen;
+static enum layout layout;
+
+/* highest number in DELIVAL, the next queued delete gets the next number */
+static int delmax;
+
+/* highest number in SNAPPREFIX, the next new snapshot gets the next number */
+static int seqmax;
+
 static void movein(struct snapshot *, struct snapinterval *, time_t, int);
+void qdel(const char *, int);
+static void purge(const struct endpoint *);
 static void spreadout(struct endpoint *, time_t);
 
+/*
+ * Return the interval name, SYNCDIR or DELIVAL that equals the first "len"
+ * characters of "name", or NULL if it is none of these.
+ */
+static const char *
+idxname(const struct endpoint *ep, const char *name, size_t len)
+{
+	struct snapinterval **siv;
+
+	for (siv = ep->snapshots; siv && *siv; siv++)
+		if (strlen((*siv)->name) == len &&
+		    strncmp((*siv)->name, name, len) == 0)
+			return (*siv)->name;
+
+	if (strlen(SYNCDIR) == len && strncmp(SYNCDIR, name, len) == 0)
+		return SYNCDIR;
+
+	if (strlen(DELIVAL) == len && strncmp(DELIVAL, name, len) == 0)
+		return DELIVAL;
+
+	return NULL;
+}
+
+/*
+ * Return whether "name" is an interval name, as returned by idxname.
+ */
+static int
+isinterval(const char *name)
+{
+	return strcmp(name, SYNCDIR) != 0 && strcmp(name, DELIVAL) != 0;
+}
+
+/*
+ * Find a snapshot directory in the index.
+ *
+ * Return the entry if found or NULL if not.
+ */
+static struct snapent *
+findent(const char *name, int number)
+{
+	size_t i;
+
+	for (i = 0; i < snapidxlen; i++)
+		if (snapidx[i].number == number &&
+		    strcmp(snapidx[i].name, name) == 0)
+			return &snapidx[i];
+
+	return NULL;
+}
+
+/*
+ * Add a snapshot directory to the index.
+ */
+static void
+addent(const char *name, int number, int isdir, time_t born)
+{
+	snapidx = reallocarray(snapidx, snapidxlen + 1, sizeof(*snapidx));
+	if (snapidx == NULL)
+		err(1, "%s: reallocarray", __func__);
+
+	snapidx[snapidxlen].name = name;
+	snapidx[snapidxlen].number = number;
+	snapidx[snapidxlen].isdir = isdir;
+	snapidx[snapidxlen].born = born;
+	snapidx[snapidxlen].seq = 0;
+	snapidxlen++;
+}
+
+/*
+ * Remove a snapshot directory from the index.
+ */
+static void
+rment(const char *name, int number)
+{
+	struct snapent *e;
+
+	if ((e = findent(name, number)) == NULL)
+		return;
+
+	*e = snapidx[--snapidxlen];
+}
+
+/*
+ * Return the name of a snapshot directory on disk. The caller should free(3)
+ * the result.
+ */
+static char *
+entpath(const struct snapent *e)
+{
+	if (e->seq > 0)
+		return snapdirstr(SNAPPREFIX, e->seq);
+
+	return snapdirstr(e->name, e->number);
+}
+
+/*
+ * Order snapshots from newest to oldest.
+ */
+static int
+cmpborn(const void *a, const void *b)
+{
+	const struct snapent *ea = *(struct snapent * const *)a;
+	const struct snapent *eb = *(struct snapent * const *)b;
+
+	if (ea->born != eb->born)
+		return ea->born > eb->born ? -1 : 1;
+	if (ea->seq != eb->seq)
+		return ea->seq > eb->seq ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Collect all entries in the index of which the directory has a fixed name, if
+ * "fixed" is set, or that are still named after their interval otherwise.
+ * Return them from newest to oldest. The caller should free(3) the result.
+ */
+static struct snapent **
+collectsnaps(int fixed, size_t *n)
+{
+	struct snapent **v;
+	size_t i;
+
+	if ((v = reallocarray(NULL, snapidxlen + 1, sizeof(*v))) == NULL)
+		err(1, "%s: reallocarray", __func__);
+
+	*n = 0;
+	for (i = 0; i < snapidxlen; i++)
+		if (fixed ? snapidx[i].seq > 0 :
+		    snapidx[i].seq == 0 && isinterval(snapidx[i].name))
+			v[(*n)++] = &snapidx[i];
+
+	qsort(v, *n, sizeof(*v), cmpborn);
+
+	return v;
+}
+
+/*
+ * Give all snapshots that are still named after their interval a fixed name,
+ * oldest first so that the numbers follow the age of the snapshots.
+ */
+static void
+migrate(void)
+{
+	struct snapent **v;
+	size_t n;
+	char *src, *dst;
+
+	v = collectsnaps(0, &n);
+
+	while (n > 0) {
+		n--;
+
+		if (seqmax == INT_MAX - 1)
+			errx(1, "max number of snapshots reached: %d in %s",
+				seqmax, SNAPPREFIX);
+
+		src = entpath(v[n]);
+		v[n]->seq = ++seqmax;
+		dst = entpath(v[n]);
+
+		if (verbose > 0)
+			fprintf(stdout, "rotator[%d]: migrate %s -> %s\n",
+				getpid(), src, dst);
+
+		if (rename(src, dst) == -1)
+			err(1, "rotator[%d]: rename %s to %s", getpid(), src,
+				dst);
+
+		free(src);
+		src = NULL;
+		free(dst);
+		dst = NULL;
+	}
+
+	free(v);
+}
+
+/*
+ * Derive the interval and position of every snapshot with a fixed name of which
+ * the position is not known from its name or link, from its age. Rotation
+ * keeps the snapshots of all intervals in order of age, so each such snapshot
+ * gets the first free position after the next newer snapshot. Intervals that
+ * are partially filled keep their known snapshots where they are. Any surplus
+ * ends up after the last interval and is queued for deletion by spreadout.
+ */
+static void
+placesnaps(const struct endpoint *ep)
+{
+	struct snapinterval **siv;
+	struct snapent **v;
+	size_t i, n;
+	int number;
+
+	v = collectsnaps(1, &n);
+
+	siv = ep->snapshots;
+	number = 0;
+	for (i = 0; i < n; i++) {
+		if (strcmp(v[i]->name, SNAPPREFIX) != 0) {
+			/* continue after a snapshot with a known position */
+			for (siv = ep->snapshots; *(siv + 1) != NULL; siv++)
+				if (strcmp((*siv)->name, v[i]->name) == 0)
+					break;
+			number = v[i]->number;
+			continue;
+		}
+
+		do {
+			if (number >= (*siv)->count && *(siv + 1) != NULL) {
+				siv++;
+				number = 0;
+			}
+			number++;
+		} while (findent((*siv)->name, number) != NULL);
+
+		v[i]->name = (*siv)->name;
+		v[i]->number = number;
+	}
+
+	free(v);
+}
+
+/*
+ * Return the number of the SNAPPREFIX directory a symlink made by a fixed
+ * layout points to, or 0 if it is no such link.
+ */
+static int
+linkseq(const struct endpoint *ep, const char *link)
+{
+	char target[PATH_MAX];
+	const char *errstr;
+	ssize_t len;
+	int seq;
+
+	len = readlinkat(ep->pathfd, link, target, sizeof(target) - 1);
+	if (len == -1)
+		return 0;
+	target[len] = '\0';
+
+	if (strncmp(target, SNAPPREFIX ".", strlen(SNAPPREFIX ".")) != 0)
+		return 0;
+
+	seq = strtonum(target + strlen(SNAPPREFIX "."), 1, INT_MAX - 1,
+		&errstr);
+	if (errstr != NULL)
+		return 0;
+
+	return seq;
+}
+
+/*
+ * Give each snapshot with a fixed name the position of the link in "links" that
+ * points to it, unless that position is already taken.
+ */
+static void
+placelinks(const struct snapent *links, size_t n)
+{
+	size_t i, j;
+
+	for (i = 0; i < n; i++) {
+		if (findent(links[i].name, links[i].number) != NULL)
+			continue;
+
+		for (j = 0; j < snapidxlen; j++)
+			if (snapidx[j].seq == links[i].seq &&
+			    strcmp(snapidx[j].name, SNAPPREFIX) == 0)
+				break;
+
+		if (j < snapidxlen) {
+			snapidx[j].name = links[i].name;
+			snapidx[j].number = links[i].number;
+		}
+	}
+}
+
+/*
+ * Replace a symlink made by a fixed layout with the snapshot it points to.
+ *
+ * Return 0 on success, or -1 on error with errno set.
+ */
+static int
+restorelink(const struct endpoint *ep, const char *link)
+{
+	char target[PATH_MAX];
+	ssize_t len;
+
+	len = readlinkat(ep->pathfd, link, target, sizeof(target) - 1);
+	if (len == -1)
+		return -1;
+	target[len] = '\0';
+
+	if (strncmp(target, SNAPPREFIX ".", strlen(SNAPPREFIX ".")) != 0 ||
+	    strchr(target, '/') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return renameat(ep->pathfd, target, ep->pathfd, link);
+}
+
+/*
+ * Make interval.number a symlink to each snapshot in a fixed layout and remove
+ * the links after the last snapshot of each interval. Existing links are only
+ * replaced if they point elsewhere.
+ */
+static void
+linksnaps(const struct endpoint *ep)
+{
+	struct snapinterval **siv;
+	struct snapent *e;
+	char *link, *target, cur[PATH_MAX];
+	ssize_t len;
+	int n, r;
+
+	if (layout != LAYOUTFIXED)
+		return;
+
+	for (siv = ep->snapshots; *siv; siv++) {
+		for (n = 1; n < INT_MAX; n++) {
+			link = snapdirstr((*siv)->name, n);
+
+			if ((e = findent((*siv)->name, n)) == NULL) {
+				r = unlinkat(ep->pathfd, link, 0);
+				if (r == -1 && errno != ENOENT)
+					err(1, "rotator[%d]: unlink %s",
+						getpid(), link);
+				free(link);
+				link = NULL;
+
+				if (r == -1)
+					break;
+				continue;
+			}
+
+			target = entpath(e);
+
+			len = readlinkat(ep->pathfd, link, cur, sizeof(cur) - 1);
+			if (len != -1)
+				cur[len] = '\0';
+
+			if (len == -1 || strcmp(cur, target) != 0) {
+				if (unlinkat(ep->pathfd, LINKTMP, 0) == -1 &&
+				    errno != ENOENT)
+					err(1, "rotator[%d]: unlink %s",
+						getpid(), LINKTMP);
+				if (symlinkat(target, ep->pathfd, LINKTMP) == -1)
+					err(1, "rotator[%d]: symlink %s",
+						getpid(), target);
+				if (renameat(ep->pathfd, LINKTMP, ep->pathfd,
+				    link) == -1)
+					err(1, "rotator[%d]: rename %s to %s",
+						getpid(), LINKTMP, link);
+			}
+
+			free(target);
+			target = NULL;
+			free(link);
+			link = NULL;
+		}
+	}
+}
+
+/*
+ * Build the index of all snapshot directories of the location with a single
+ * scan of the directory and one fstatat(2) per snapshot. All rotation decisions
+ * are made on this index, which is kept in sync with every rename and delete.
+ *
+ * In a fixed layout, snapshots that are still named after their interval are
+ * given a fixed name and keep their position. Other snapshots get the position
+ * of the link that points to them, or one derived from their age. In a rename
+ * layout, snapshots left behind as symlinks by a fixed layout are moved back in
+ * place and the ones without a link are deleted.
+ */
+static void
+loadindex(const struct endpoint *ep)
+{
+	struct dirent *de;
+	struct snapent *links;
+	struct stat st;
+	const char *errstr, *name;
+	char *dot, *tmp;
+	DIR *dir;
+	size_t i, len, nlinks, norphans;
+	int fd, number, seq, *orphans;
+
+	layout = ep->layout;
+
+	links = NULL;
+	nlinks = 0;
+	orphans = NULL;
+	norphans = 0;
+
+	if ((fd = dup(ep->pathfd)) == -1)
+		err(1, "%s: dup", __func__);
+	if ((dir = fdopendir(fd)) == NULL)
+		err(1, "%s: fdopendir", __func__);
+
+	for (;;) {
+		errno = 0;
+		if ((de = readdir(dir)) == NULL)
+			break;
+
+		/* Only consider names like interval.1 without leading zeros. */
+		if ((dot = strrchr(de->d_name, '.')) == NULL ||
+		    dot == de->d_name || !isdigit((unsigned char)dot[1]) ||
+		    dot[1] == '0')
+			continue;
+
+		number = strtonum(dot + 1, 1, INT_MAX - 1, &errstr);
+		if (errstr != NULL)
+			continue;
+
+		len = dot - de->d_name;
+
+		if (len == strlen(SNAPPREFIX) &&
+		    strncmp(de->d_name, SNAPPREFIX, len) == 0) {
+			if (fstatat(ep->pathfd, de->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == -1)
+				err(1, "%s: fstatat %s", __func__, de->d_name);
+
+			if (!S_ISDIR(st.st_mode))
+				continue;
+
+			/* Check for orphans once all links are restored. */
+			if (layout != LAYOUTFIXED) {
+				if ((orphans = reallocarray(orphans,
+				    norphans + 1, sizeof(*orphans))) == NULL)
+					err(1, "%s: reallocarray", __func__);
+				orphans[norphans++] = number;
+				continue;
+			}
+
+			addent(SNAPPREFIX, number, 1, st.st_mtim.tv_sec);
+			snapidx[snapidxlen - 1].seq = number;
+
+			if (number > seqmax)
+				seqmax = number;
+			continue;
+		}
+
+		if ((name = idxname(ep, de->d_name, len)) == NULL)
+			continue;
+
+		if (fstatat(ep->pathfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)
+		    == -1)
+			err(1, "%s: fstatat %s", __func__, de->d_name);
+
+		if (isinterval(name) && !S_ISDIR(st.st_mode)) {
+			/* Links are made again by linksnaps. */
+			if (layout == LAYOUTFIXED) {
+				if (!S_ISLNK(st.st_mode) ||
+				    (seq = linkseq(ep, de->d_name)) == 0)
+					continue;
+
+				links = reallocarray(links, nlinks + 1,
+					sizeof(*links));
+				if (links == NULL)
+					err(1, "%s: reallocarray", __func__);
+				links[nlinks].name = name;
+				links[nlinks].number = number;
+				links[nlinks].seq = seq;
+				nlinks++;
+				continue;
+			}
+
+			if (S_ISLNK(st.st_mode)) {
+				if (restorelink(ep, de->d_name) == -1) {
+					warn("rotator[%d]: restore %s",
+						getpid(), de->d_name);
+					continue;
+				}
+
+				if (fstatat(ep->pathfd, de->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1)
+					err(1, "%s: fstatat %s", __func__,
+						de->d_name);
+			}
+		}
+
+		addent(name, number, S_ISDIR(st.st_mode), st.st_mtim.tv_sec);
+
+		if (strcmp(name, DELIVAL) == 0 && number > delmax)
+			delmax = number;
+	}
+
+	if (errno != 0)
+		err(1, "%s: readdir", __func__);
+
+	if (closedir(dir) == -1)
+		err(1, "%s: closedir", __func__);
+
+	if (layout == LAYOUTFIXED) {
+		migrate();
+		placelinks(links, nlinks);
+		placesnaps(ep);
+	}
+
+	free(links);
+
+	/*
+	 * Snapshots of a fixed layout that no link pointed to are not part of
+	 * any interval, queue them for deletion.
+	 */
+	for (i = 0; i < norphans; i++) {
+		tmp = snapdirstr(SNAPPREFIX, orphans[i]);
+		if (fstatat(ep->pathfd, tmp, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			/* restored by restorelink */
+			if (errno != ENOENT)
+				err(1, "%s: fstatat %s", __func__, tmp);
+		} else if (S_ISDIR(st.st_mode)) {
+			addent(SNAPPREFIX, orphans[i], 1, st.st_mtim.tv_sec);
+			qdel(SNAPPREFIX, orphans[i]);
+		}
+		free(tmp);
+		tmp = NULL;
+	}
+
+	free(orphans);
+}
+
+/*
+ * Rename a snapshot directory on disk and in the index. In a fixed layout only
+ * the index is updated, unless the snapshot is new and gets its fixed name, or
+ * is queued for deletion.
+ */
+static void
+renamesnap(const char *sname, int snumber, const char *dname, int dnumber)
+{
+	struct snapent *e;
+	char *src, *dst;
+	int seq;
+
+	if ((e = findent(sname, snumber)) == NULL)
+		errx(1, "rotator[%d]: %s.%d not indexed", getpid(), sname,
+			snumber);
+
+	src = entpath(e);
+
+	seq = 0;
+	if (layout == LAYOUTFIXED && isinterval(dname)) {
+		if ((seq = e->seq) == 0) {
+			if (seqmax == INT_MAX - 1)
+				errx(1, "max number of snapshots reached: %d "
+					"in %s", seqmax, SNAPPREFIX);
+			seq = ++seqmax;
+		}
+		dst = snapdirstr(SNAPPREFIX, seq);
+	} else {
+		dst = snapdirstr(dname, dnumber);
+	}
+
+	if (strcmp(src, dst) != 0 && rename(src, dst) == -1)
+		err(1, "rotator[%d]: rename %s to %s", getpid(), src, dst);
+
+	free(src);
+	src = NULL;
+	free(dst);
+	dst = NULL;
+
+	rment(dname, dnumber);
+
+	/* The entry might have been moved by rment. */
+	e = findent(sname, snumber);
+	e->name = dname;
+	e->number = dnumber;
+	e->seq = seq;
+}
+
+/*
+ * Determine the ttl of a snapshot using the index, see snapshotttl.
+ */
+static time_t
+idxttl(struct snapshot *s, time_t now, time_t *age)
+{
+	struct snapent *e;
+
+	if ((e = findent(s->name, s->number)) == NULL)
+		return bornttl(s, -1, now, age);
+
+	return bornttl(s, e->born, now, age);
+}
+
+/*
+ * Find the newest snapshot in the index, see newestsnapshot.
+ */
+static struct snapshot *
+idxnewest(struct endpoint *ep, struct snapshot *s)
+{
+	struct snapinterval **siv;
+	int i;
+
+	for (siv = ep->snapshots; siv && *siv; siv++) {
+		for (i = 1; i <= (*siv)->count; i++) {
+			if (findent((*siv)->name, i) == NULL)
+				continue;
+
+			if (setsnapshot(ep, (*siv)->name, i, s) == -1)
+				err(1, "%s: setsnapshot", __func__);
+
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the snapshots the syncer uses as link-dest in the index, see
+ * linkdestsnapshots.
+ */
+static int
+idxlinkdests(struct endpoint *ep, struct snapshot *sv, int max)
+{
+	struct snapinterval **siv;
+	int i, more, n;
+
+	n = 0;
+	for (i = 1; n < max; i++) {
+		more = 0;
+
+		for (siv = ep->snapshots; siv && *siv && n < max; siv++) {
+			if (i > (*siv)->count)
+				continue;
+
+			more = 1;
+
+			if (findent((*siv)->name, i) == NULL)
+				continue;
+
+			if (setsnapshot(ep, (*siv)->name, i, &sv[n++]) == -1)
+				err(1, "%s: setsnapshot", __func__);
+		}
+
+		if (!more)
+			break;
+	}
+
+	return n;
+}
+
 /*
  * Grant access for the syncer process to a snapshot on disk.
  *
@@ -43,12 +707,14 @@ blocksyncer(struct snapshot *s)
 
 /*
  * Create a new sync dir for the given root, make sure it is writable by the
- * endpoint group. It is considered an error if the syncdir already exists.
+ * endpoint group. If "reuse" is set an existing sync dir is prepared for the
+ * syncer again, otherwise it is considered an error if the syncdir already
+ * exists.
  *
  * Return 0 on success, or -1 on error and set errno.
  */
 static int
-newsyncdir(const struct endpoint *ep)
+newsyncdir(const struct endpoint *ep, int reuse)
 {
 	int r;
 	char *path;
@@ -61,7 +727,8 @@ newsyncdir(const struct endpoint *ep)
 	 * Ensure it's fully accessible for the owner and group only.
 	 */
 
-	if ((r = mkdirat(ep->pathfd, path, S_IRWXU | S_IRWXG)) == -1)
+	if (!reuse &&
+	    (r = mkdirat(ep->pathfd, path, S_IRWXU | S_IRWXG)) == -1)
 		goto end;
 
 	if ((r = fchmodat(ep->pathfd, path, S_IRWXU | S_IRWXG, 0)) == -1)
@@ -70,6 +737,10 @@ newsyncdir(const struct endpoint *ep)
 	if ((r = fchownat(ep->pathfd, path, -1, ep->gid, 0)) == -1)
 		goto end;
 
+	/* The time is set when the snapshot is rolled in. */
+	if (!reuse)
+		addent(SYNCDIR, 1, 1, 0);
+
 end:
 	free(path);
 	path = NULL;
@@ -77,165 +748,109 @@ end:
 }
 
 /*
- * Remove the given path recursively.
- *
- * Slimmed down copy of /bin/rm/rm.c.
- *
- *	$OpenBSD: rm.c,v 1.42 2017/06/27 21:49:47 tedu Exp $
- *	$NetBSD: rm.c,v 1.19 1995/09/07 06:48:50 jtc Exp $
- *
- * Copyright (c) 1990, 1993, 1994
- *	The Regents of the University of California.  All rights reserved.
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
+ * Find the backup with the highest number in the given interval.
  *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
+ * Return the number of the oldest backup found or 0 if none is found. Return -1
+ * on error and set errno.
  */
-void
-rm_tree(char **argv)
+int
+maxbackup(const char *ivalname)
 {
-	FTS *fts;
-	FTSENT *p;
-	int flags;
-
-	flags = FTS_PHYSICAL | FTS_NOSTAT;
+	struct snapent *e;
+	int n;
 
-	if ((fts = fts_open(argv, flags, NULL)) == NULL)
-		err(1, "fts_open");
+	for (n = 1; n < INT_MAX; n++) {
+		if ((e = findent(ivalname, n)) == NULL)
+			return n - 1;
 
-	while ((p = fts_read(fts)) != NULL) {
-		switch (p->fts_info) {
-		case FTS_D:
-			/* first pass */
-			continue;
+		if (!e->isdir) {
+			errno = ENOTDIR;
+			return -1;
+		}
+	}
 
-		case FTS_ERR:
-			errc(1, p->fts_errno, "%s", p->fts_path);
-			break;
+	errno = ERANGE;
+	return -1;
+}
 
-		case FTS_DNR:
-			/*
-			 * If we can't read or search the directory, may still be
-			 * able to remove it. Don't print out the un{read,search}able
-			 * message unless the remove fails.
-			 */
-			errc(1, p->fts_errno, "%s", p->fts_path);
-			if (rmdir(p->fts_accpath) == -1)
-				warn("rmdir");
-			break;
+/*
+ * Queue deletion of a snapshot. The number in DELIVAL is taken from a counter,
+ * so that queueing does not depend on the number of queued snapshots.
+ */
+void
+qdel(const char *name, int number)
+{
+	if (delmax == INT_MAX - 1)
+		errx(1, "max number of snapshots reached: %d in %s", delmax,
+			DELIVAL);
 
-		case FTS_DP:
-			if (rmdir(p->fts_accpath) == -1)
-				err(1, "rmdir");
-			break;
+	delmax++;
 
-		default:
-			if (unlink(p->fts_accpath) == -1)
-				warn("%s", p->fts_path);
-		}
-	}
+	if (verbose > 0)
+		fprintf(stdout, "rotator[%d]: %s.%d -> %s.%d\n", getpid(), name,
+			number, DELIVAL, delmax);
 
-	if (errno != 0)
-		err(1, "fts_read");
-	if (fts_close(fts) == -1)
-		err(1, "fts_close");
+	renamesnap(name, number, DELIVAL, delmax);
 }
 
 /*
- * Find the backup with the highest number in the given interval.
- *
- * Return the number of the oldest backup found or 0 if none is found. Return -1
- * on error and set errno.
+ * Delete all snapshots in DELIVAL, including any left behind by previous runs
+ * since they are in the index as well. Walk the index backwards since removing
+ * an entry moves the last entry in its place.
  */
-int
-maxbackup(const char *ivalname)
+static void
+purge(const struct endpoint *ep)
 {
-	char *p;
-	struct stat st;
+	size_t i;
+	char *tmp;
 	int n;
 
-	p = NULL;
-	n = 0;
-	while (n < INT_MAX) {
-		free(p);
-		p = NULL;
-		n++;
-
-		if (asprintf(&p, "%s.%d", ivalname, n) <= 0)
-			err(1, "%s: asprintf", __func__);
+	for (i = snapidxlen; i > 0; i--) {
+		if (strcmp(snapidx[i - 1].name, DELIVAL) != 0)
+			continue;
 
-		if (stat(p, &st) == -1) {
-			if (errno != ENOENT)
-				err(1, "%s: stat", __func__);
+		n = snapidx[i - 1].number;
+		tmp = snapdirstr(DELIVAL, n);
 
-			/* encountered the first non-existing dir */
-			n--;
-			break;
+		if (verbose > 1)
+			fprintf(stdout, "rotator[%d]: removing %s\n", getpid(),
+				tmp);
+
+		if (!snapidx[i - 1].isdir) {
+			if (unlinkat(ep->pathfd, tmp, 0) == -1)
+				warn("rotator[%d]: unlink %s", getpid(), tmp);
+		} else if (rmtree(ep->pathfd, tmp, ep->rmthreads, ep->rmrate,
+		    ep->rmload) == -1) {
+			warnx("rotator[%d]: could not remove %s", getpid(),
+				tmp);
 		}
 
-		if ((st.st_mode & S_IFMT) != S_IFDIR) {
-			errno = ENOTDIR;
-			n = -1;
-			break;
-		}
-	}
-	if (n == INT_MAX) {
-		errno = ERANGE;
-		n = -1;
-	}
+		free(tmp);
+		tmp = NULL;
 
-	free(p);
-	p = NULL;
-	return n;
+		rment(DELIVAL, n);
+	}
 }
 
-/* Queue deletion of a snapshot. */
-void
-qdel(const char *src)
+/*
+ * Wait until the master signals us to start, or to prestage if "go" is
+ * CMDPRESTAGE.
+ *
+ * Return 1 if we may start or 0 if we must stop.
+ */
+static int
+waitstart(const struct endpoint *ep, int go)
 {
-	int i;
-	char *dst;
-
-	/*
-	 * Determine the number of snapshots in DELIVAL.
-	 */
-
-	if ((i = maxbackup(DELIVAL)) == -1)
-		err(1, "maxbackup %s", DELIVAL);
-
-	/* maxbackup guarantees i < INT_MAX */
-	if (i == (INT_MAX - 1))
-		err(1, "max number of snapshots reached: %d in %s", i, DELIVAL);
+	int cmd;
 
-	dst = snapdirstr(DELIVAL, i + 1);
+	if (readcmd(ep->rotfd, &cmd) == -1)
+		err(1, "%s: %s read error", __func__, getepid(ep));
 
-	if (verbose > 0)
-		fprintf(stdout, "rotator[%d]: %s -> %s\n", getpid(), src, dst);
-	if (rename(src, dst) == -1)
-		err(1, "%s: rename %s", __func__, src);
+	if (cmd != go && cmd != CMDSTOP)
+		errx(1, "%s: %s unexpected command: %d", __func__, getepid(ep),
+			cmd);
 
-	free(dst);
-	dst = NULL;
+	return cmd == go;
 }
 
 /*
@@ -246,12 +861,14 @@ qdel(const char *src)
 void
 rotator(struct endpoint *ep, time_t starttime, int force)
 {
-	struct snapshot s, firstoffirst, newestondisk;
+	struct snapshot s, newestondisk, linkdest[MAXLINKDESTS];
+	struct histent hist[HISTSIZE], new;
+	struct snapent *e;
 	struct flock fl;
-	struct stat st;
-	int n, fd, cmd;
+	int fd, histfd, purgefd, purging, resumed, nhist, nlinkdest, cmd, due;
+	int i;
 	time_t age, ttl;
-	char *src[2], *tmp, *pathinfo;
+	char *tmp, *pathinfo, *src, *dst;
 
 	/* Sandbox */
 
@@ -264,7 +881,9 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 		err(1, "%s: chroot %s", __func__, pathinfo);
 	snaps_endpoint_chpath(ep, "/");
 
-	if (pledge("stdio flock wpath rpath cpath fattr chown", NULL) == -1)
+	if (pledge(ep->asyncpurge ?
+	    "stdio flock wpath rpath cpath fattr chown proc" :
+	    "stdio flock wpath rpath cpath fattr chown", NULL) == -1)
 		err(1, "%s: pledge", __func__);
 
 	/* expect stdout, stderr, pathfd and the communication channel only */
@@ -279,15 +898,12 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 	if (getdtablecount() != 4)
 		errx(1, "fd leak: %d", getdtablecount());
 
-	/* Wait until we're ready to start. */
-	if (readcmd(ep->rotfd, &cmd) == -1)
-		err(1, "%s: %s read error", __func__, getepid(ep));
-
-	if (cmd != CMDSTART && cmd != CMDSTOP)
-		errx(1, "%s: %s unexpected command: %d", __func__, getepid(ep),
-			cmd);
-
-	if (cmd == CMDSTOP)
+	/*
+	 * Wait until we're ready to start. If the sync dir is prestaged, wait
+	 * until we may prepare it instead and wait for the start after it is
+	 * prepared.
+	 */
+	if (!waitstart(ep, ep->prestage ? CMDPRESTAGE : CMDSTART))
 		exit(0);
 
 	/* Make sure there is an interval. */
@@ -296,16 +912,14 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 
 	/*
 	 * We're done if the first snapshot of the first interval has not
-	 * expired yet and force is false.
+	 * expired yet and force is false. The master already checked this
+	 * before forking us, but time might have passed.
 	 */
 
-	if (setsnapshot(ep, ep->snapshots[0]->name, 1, &firstoffirst) == -1)
-		err(1, "%s: setsnapshot", __func__);
-
-	if ((ttl = snapshotttl(&firstoffirst, starttime, &age)) == -1)
-		err(1, "%s: snapshotttl", __func__);
+	if ((due = snapshotdue(ep, starttime, &ttl, &age)) == -1)
+		err(1, "%s: snapshotdue", __func__);
 
-	if (!force && (ttl - TIMEPAD) > 0) {
+	if (!force && !due) {
 		if (verbose > 0) {
 			tmp = strdup(humanduration(age));
 			fprintf(stdout, "  %s %s left (%s old)\n",
@@ -326,7 +940,8 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 			ep->uid, ep->gid);
 
 		if (ttl == 0 && age == 0)
-			fprintf(stdout, "first %s backup)\n", firstoffirst.name);
+			fprintf(stdout, "first %s backup)\n",
+				ep->snapshots[0]->name);
 		else
 			fprintf(stdout, "%s old)\n", humanduration(age));
 	}
@@ -364,53 +979,141 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 			getepid(ep), fl.l_pid);
 	}
 
-	/* Cleanup any left-behind sync dir. */
+	/*
+	 * Open the history of sync durations while we may still create files.
+	 * The master uses it to schedule the longest syncs first.
+	 */
 
-	if ((src[0] = getsyncdir()) == NULL)
-		err(1, "rotator[%d]: getsyncdir", getpid());
+	if ((histfd = open(HISTFILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600))
+	    == -1)
+		err(1, "rotator[%d]: open %s", getpid(), HISTFILE);
 
-	src[1] = NULL;
+	if ((nhist = readhistory(histfd, hist)) == -1) {
+		warn("rotator[%d]: %s: readhistory", getpid(), getepid(ep));
+		nhist = 0;
+	}
 
-	if (fstatat(ep->pathfd, src[0], &st, AT_SYMLINK_NOFOLLOW) == -1) {
-		if (errno != ENOENT)
-			err(1, "rotator[%d]: could not stat sync dir",
-				getpid());
-	} else {
-		if ((st.st_mode & S_IFMT) != S_IFDIR) {
+	loadindex(ep);
+	linksnaps(ep);
+
+	/*
+	 * Only one process may remove queued snapshots at a time. A reaper of a
+	 * previous run might still be busy, in which case it is left alone and
+	 * the snapshots queued by this run are removed by a next run. The lock
+	 * is inherited by a reaper since it is a flock(2).
+	 */
+
+	if ((purgefd = open(PURGELOCK, O_WRONLY | O_CREAT | O_CLOEXEC, 0600))
+	    == -1)
+		err(1, "rotator[%d]: open %s", getpid(), PURGELOCK);
+
+	purging = 1;
+	if (flock(purgefd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno != EWOULDBLOCK)
+			err(1, "rotator[%d]: flock %s", getpid(), PURGELOCK);
+
+		if (verbose > 0)
+			fprintf(stdout, "rotator[%d]: previous removal of old "
+				"snapshots still running\n", getpid());
+		purging = 0;
+	}
+
+	/* Cleanup or resume any left-behind sync dir. */
+
+	resumed = 0;
+	if ((e = findent(SYNCDIR, 1)) != NULL) {
+		if (!e->isdir) {
 			errno = ENOTDIR;
 			err(1, "rotator[%d]: sync dir exists but is not"
 				" a directory", getpid());
 		}
 
-		/*
-		 * Schedule a delete of the orphaned dir so that our start won't
-		 * be delayed.
-		 */
+		if (ep->resume) {
+			/*
+			 * Let the syncer continue where an interrupted sync
+			 * stopped, the newest snapshot is still used as
+			 * link-dest.
+			 */
 
-		if (verbose > 0)
-			fprintf(stdout, "rotator[%d]: scheduled delete of "
-				"orphaned sync dir...\n", getpid());
+			if (verbose > 0)
+				fprintf(stdout, "rotator[%d]: resume orphaned "
+					"sync dir\n", getpid());
 
-		qdel(src[0]);
-	}
+			resumed = 1;
+		} else {
+			/*
+			 * Schedule a delete of the orphaned dir so that our
+			 * start won't be delayed.
+			 */
 
-	free(src[0]);
-	src[0] = NULL;
+			if (verbose > 0)
+				fprintf(stdout, "rotator[%d]: scheduled delete "
+					"of orphaned sync dir...\n", getpid());
+
+			qdel(SYNCDIR, 1);
+		}
+	}
 
 	/*
-	 * Setup a new sync dir for the syncer.
+	 * Setup a new sync dir for the syncer, or reuse the orphaned one.
 	 */
 
-	if (newsyncdir(ep) == -1)
+	if (newsyncdir(ep, resumed) == -1)
 		err(1, "rotator[%d]: newsyncdir", getpid());
 
+	/*
+	 * Clone the directory hierarchy of the newest snapshot into the new
+	 * sync dir while we're still queued, so that the syncer only has to
+	 * create new directories. Files are left to the link-dest of the
+	 * syncer, a file that is shared with the newest snapshot would get its
+	 * metadata changes applied to that snapshot as well.
+	 */
+
+	if (ep->prestage && !resumed && idxnewest(ep, &newestondisk)) {
+		e = findent(newestondisk.name, newestondisk.number);
+		src = entpath(e);
+		dst = getsyncdir();
+
+		if (verbose > 0)
+			fprintf(stdout, "rotator[%d]: clone %s\n", getpid(),
+				src);
+
+		if (dirtree(ep->pathfd, src, dst, ep->prestagethreads) == -1)
+			warnx("rotator[%d]: could not clone %s", getpid(),
+				src);
+
+		free(src);
+		src = NULL;
+		free(dst);
+		dst = NULL;
+	}
+
+	/* Signal the master the sync dir is prepared. */
+	if (ep->prestage && writecmd(ep->rotfd, CMDREADY) == -1)
+		err(1, "rotator[%d]: %s write ready error", getpid(),
+			getepid(ep));
+
+	if (ep->prestage && !waitstart(ep, CMDSTART)) {
+		if (!ep->resume)
+			qdel(SYNCDIR, 1);
+		if (unlink(LOCKFILE) == -1)
+			err(1, "unlink");
+		exit(0);
+	}
+
 	/* Pledge drop flock, chown and wpath. */
-	if (pledge("stdio rpath cpath fattr", NULL) == -1)
+	if (pledge(ep->asyncpurge ? "stdio rpath cpath fattr proc" :
+	    "stdio rpath cpath fattr", NULL) == -1)
 		err(1, "%s: pledge", __func__);
 
-	/* Grant access to the newest snapshot for rsync link-dest optimization. */
-	if (newestsnapshot(ep, &newestondisk))
-		if (allowsyncer(&newestondisk) == -1)
+	/*
+	 * Grant access to the snapshots used for the rsync link-dest
+	 * optimization.
+	 */
+	nlinkdest = idxlinkdests(ep, linkdest, ep->linkdests);
+
+	for (i = 0; i < nlinkdest; i++)
+		if (allowsyncer(&linkdest[i]) == -1)
 			err(1, "rotator[%d]: allowsyncer", getpid());
 
 	/* Signal that we're ready and wait until we may proceed. */
@@ -420,6 +1123,20 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 	if (readcmd(ep->rotfd, &cmd) == -1)
 		err(1, "rotator[%d]: %s read error", getpid(), getepid(ep));
 
+	/*
+	 * An include is followed by the transfer statistics of the syncer, with
+	 * the time the sync took as measured by the master.
+	 */
+	memset(&new, 0, sizeof(new));
+
+	if (cmd == CMDROTINCLUDE) {
+		if (readcmd(ep->rotfd, &i) == -1 || i != CMDSTATS ||
+		    readstats(ep->rotfd, &new.stats) == -1)
+			errx(1, "rotator[%d]: %s expected statistics", getpid(),
+				getepid(ep));
+		new.duration = new.stats.elapsed;
+	}
+
 	/*
 	 * Assume the parent waited for the syncer to exit so we're free to do
 	 * whatever we want with the sync dir, without risking a compromised
@@ -429,10 +1146,10 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 	 */
 
 	/*
-	 * Revoke access from the syncer to the new snapshot and to the snapshot
+	 * Revoke access from the syncer to the new snapshot and to the snapshots
 	 * used as link-dest (if any).
 	 *
-	 * Note: the snapshot used as link-dest is still the newest as long as
+	 * Note: the snapshots used as link-dest keep their positions as long as
 	 * the new snapshot is not moved in.
 	 */
 
@@ -442,61 +1159,88 @@ rotator(struct endpoint *ep, time_t starttime, int force)
 	if (blocksyncer(&s) == -1)
 		err(1, "rotator[%d]: blocksyncer new snapshot", getpid());
 
-	if (newestsnapshot(ep, &newestondisk))
-		if (blocksyncer(&newestondisk) == -1)
+	for (i = 0; i < nlinkdest; i++)
+		if (blocksyncer(&linkdest[i]) == -1)
 			err(1, "rotator[%d]: blocksyncer previous snapshot",
 				getpid());
 
 	/* Reset the snapshot time for future reference. */
 	setsnapshottime(&s, starttime);
+	if ((e = findent(SYNCDIR, 1)) != NULL)
+		e->born = starttime;
 
 	/* Pledge drop fattr. */
-	if (pledge("stdio rpath cpath", NULL) == -1)
+	if (pledge(ep->asyncpurge ? "stdio rpath cpath proc" :
+	    "stdio rpath cpath", NULL) == -1)
 		err(1, "%s: pledge", __func__);
 
-	if (cmd == CMDROTCLEANUP) {
+	if (cmd == CMDROTCLEANUP && ep->resume) {
+		/* Leave the sync dir so that a next run can resume it. */
+		if (verbose > 0)
+			fprintf(stdout, "rotator[%d]: keep %s to resume\n",
+				getpid(), SYNCDIR);
+	} else if (cmd == CMDROTCLEANUP) {
 		if (verbose > 0)
 			fprintf(stdout, "rotator[%d]: remove %s\n", getpid(),
 				SYNCDIR);
 
-		tmp = getsyncdir();
-		qdel(tmp);
-		free(tmp);
-		tmp = NULL;
+		qdel(SYNCDIR, 1);
 	} else if (cmd == CMDROTINCLUDE) {
 		/* Move the new snapshot into the first interval. */
 
 		movein(&s, s.ep->snapshots[0], starttime, force);
 		spreadout(ep, starttime);
+
+		/*
+		 * Only remember the duration of successful syncs, if it is
+		 * known.
+		 */
+		if (new.duration >= 0 &&
+		    writehistory(histfd, hist, nhist, &new) == -1)
+			warn("rotator[%d]: %s: writehistory", getpid(),
+				getepid(ep));
 	} else {
 		errx(1, "rotator[%d]: %s unexpected command: %d", getpid(),
 			getepid(ep), cmd);
 	}
 
-	/* Delete all snapshots in DELIVAL. */
+	linksnaps(ep);
 
-	if ((n = maxbackup(DELIVAL)) == -1)
-		err(1, "rotator[%d]: maxbackup %s", getpid(), DELIVAL);
+	/*
+	 * We're done, release the lock so that a next run can start while the
+	 * queued snapshots are removed, either by us or by a reaper process that
+	 * outlives us.
+	 */
 
-	while (n) {
-		src[0] = snapdirstr(DELIVAL, n);
-		src[1] = NULL;
+	if (unlink(LOCKFILE) == -1)
+		err(1, "unlink");
 
-		if (verbose > 1)
-			fprintf(stdout, "rotator[%d]: removing %s\n", getpid(),
-				src[0]);
+	if (!purging)
+		exit(0);
 
-		rm_tree(src);
-		free(src[0]);
-		src[0] = NULL;
+	if (ep->asyncpurge) {
+		switch (fork()) {
+		case -1:
+			err(1, "rotator[%d]: fork", getpid());
+		case 0:
+			/* Let the master see the rotator is done. */
+			if (close(ep->rotfd) == -1)
+				err(1, "reaper[%d]: close", getpid());
+			ep->rotfd = -1;
 
-		n--;
-	}
+			setproctitle("reaper %s", getepid(ep));
 
-	/* We're done. */
+			if (pledge("stdio rpath cpath", NULL) == -1)
+				err(1, "reaper[%d]: pledge", getpid());
 
-	if (unlink(LOCKFILE) == -1)
-		err(1, "unlink");
+			purge(ep);
+			exit(0);
+		default:
+			exit(0);
+		}
+	}
+
+	purge(ep);
 
 	exit(0);
 }
@@ -509,7 +1253,6 @@ static void
 movein(struct snapshot *s, struct snapinterval *si, time_t starttime, int force)
 {
 	int i;
-	char *src, *dst;
 	struct snapshot s2;
 	time_t age, ttl;
 
@@ -520,8 +1263,7 @@ movein(struct snapshot *s, struct snapinterval *si, time_t starttime, int force)
 	for(i = 1; ; i++) {
 		if (setsnapshot(s->ep, si->name, i, &s2) == -1)
 			err(1, "%s: setsnapshot", __func__);
-		if ((ttl = snapshotttl(&s2, starttime, &age)) == -1)
-			err(1, "%s: snapshotttl", __func__);
+		ttl = idxttl(&s2, starttime, &age);
 
 		if (ttl == 0 && age == 0)
 			break; /* snapshot does not exist */
@@ -541,39 +1283,24 @@ movein(struct snapshot *s, struct snapinterval *si, time_t starttime, int force)
 	 * If a non-expired snapshot exists, delete the oldest expired.
 	 */
 	if ((ttl || age) && i > 0) {
-		dst = snapdirstr(si->name, i);
-		qdel(dst);
-		free(dst);
-		dst = NULL;
+		qdel(si->name, i);
 		i--;
 	}
 
 	/* Move existing expired snapshots up. */
 	while (i > 0) {
-		src = snapdirstr(si->name, i);
-		dst = snapdirstr(si->name, i + 1);
-		if (rename(src, dst) == -1)
-			err(1, "rotator[%d]: %s: rename %s to %s",
-				getpid(), __func__, src, dst);
-		free(src);
-		src = NULL;
-		free(dst);
-		dst = NULL;
+		renamesnap(si->name, i, si->name, i + 1);
 		i--;
 	}
 
 	/* Determine ttl and age of first snapshot in interval. */
 	if (setsnapshot(s->ep, si->name, 1, &s2) == -1)
 		err(1, "%s: setsnapshot", __func__);
-	if ((ttl = snapshotttl(&s2, starttime, &age)) == -1)
-		err(1, "%s: snapshotttl", __func__);
-
-	src = snapshotname(s);
-	dst = snapshotname(&s2);
+	ttl = idxttl(&s2, starttime, &age);
 
 	/* If force is true, ensure the first position is free. */
 	if ((ttl || age) && force) {
-		qdel(dst);
+		qdel(s2.name, s2.number);
 		ttl = 0;
 		age = 0;
 	}
@@ -584,20 +1311,14 @@ movein(struct snapshot *s, struct snapinterval *si, time_t starttime, int force)
 	 */
 
 	if (ttl || age)
-		qdel(src);
+		qdel(s->name, s->number);
 	else {
 		if (verbose > 1)
-			fprintf(stdout, "rotator[%d]: %s -> %s\n",
-				getpid(), src, dst);
-		if (rename(src, dst) == -1)
-			err(1, "rotator[%d]: %s: rename %s", getpid(), __func__,
-				src);
+			fprintf(stdout, "rotator[%d]: %s.%d -> %s.%d\n",
+				getpid(), s->name, s->number, s2.name,
+				s2.number);
+		renamesnap(s->name, s->number, s2.name, s2.number);
 	}
-
-	free(src);
-	src = NULL;
-	free(dst);
-	dst = NULL;
 }
 
 /*
@@ -612,7 +1333,6 @@ spreadout(struct endpoint *ep, time_t starttime)
 {
 	struct snapinterval **siv, *nsi;
 	struct snapshot s;
-	char *tmp;
 	int n;
 
 	/*
@@ -633,10 +1353,7 @@ spreadout(struct endpoint *ep, time_t starttime)
 		 */
 
 		while (n - 1 > (*siv)->count) {
-			tmp = snapdirstr((*siv)->name, n);
-			qdel(tmp);
-			free(tmp);
-			tmp = NULL;
+			qdel((*siv)->name, n);
 			n--;
 		}
 
@@ -647,10 +1364,7 @@ spreadout(struct endpoint *ep, time_t starttime)
 
 		if (n > (*siv)->count) {
 			if (nsi == NULL) {
-				tmp = snapdirstr((*siv)->name, n);
-				qdel(tmp);
-				free(tmp);
-				tmp = NULL;
+				qdel((*siv)->name, n);
 			} else {
 				if (setsnapshot(ep, (*siv)->name, n, &s) == -1)
 					err(1, "%s: setsnapshot", __func__);
@@ -2,6 +2,8 @@
 #define ROTATOR_H
 
 #define DELIVAL ".delete"
+#define PURGELOCK ".purgelock"
+#define LINKTMP ".link"
 
 #include "util.h"
 
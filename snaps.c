@@ -9,20 +9,31 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.h"
 #include "parseconfig.h"
 #include "rotator.h"
+#include "sshmux.h"
 #include "syncer.h"
 
 #define VERSION "1.0.0"
 
 #define CONFIGFILE "/etc/snaps.conf"
 #define EMPTYDIR "/var/empty"
+#define AUTORATE (8 * 1024 * 1024)	/* Bytes per second above which a
+					 * connection is considered fast.
+					 */
+#define AUTOMINXFER (64 * 1024 * 1024)	/* Bytes a sync must receive to
+					 * judge the connection on.
+					 */
+#define KILLWAIT 30	/* Seconds a process gets to exit after SIGTERM. */
 
 int verbose = 0;
 int helpopt = 0;
@@ -31,6 +42,22 @@ int forceopt = 0;	/* Force a backup, no matter how long ago the last was
 			 * taken.
 			 */
 int cfgcheckonly = 0;	/* Do a configuration check only. */
+int maxjobs = 1;	/* Maximum number of locations to process at once. */
+int jobsopt = 0;	/* Overrules maxjobs if set. */
+int daemonopt = 0;
+int devjobs = 0;	/* Maximum number of jobs per device, 0 is unlimited. */
+int hostjobs = 0;	/* Maximum number of jobs per host, 0 is unlimited. */
+enum schedule schedule = SCHEDCONFIG;
+int windowstart = -1;	/* Start of the backup window in minutes since
+			 * midnight, -1 if the window is always open.
+			 */
+int windowend = -1;	/* End of the backup window in minutes since midnight,
+			 * -1 if there is no window.
+			 */
+time_t windowclose = 0;	/* Time at which the backup window closes. */
+int forkwindow = 0;	/* Maximum number of locations with live processes, 0
+			 * means fork all processes up front.
+			 */
 
 /*
  * Use the time the program is started to determine the interval with a
@@ -40,6 +67,49 @@ time_t starttime;
 
 void print_usage(FILE *);
 
+static int cmpoverdue(const void *, const void *);
+static int cmplongest(const void *, const void *);
+static void autoprofile(struct endpoint *, const struct histent *, int);
+static void loadhistory(struct endpoint *);
+static void childcmd(struct endpoint *, int *, const char *);
+static void printstats(const struct endpoint *);
+static time_t nexttimeofday(time_t, int);
+static void runjobs(struct endpoint **);
+static struct endpoint **readconfig(const char *);
+static int checkconfig(const char *);
+static struct endpoint **keependpoint(struct endpoint **, struct endpoint *);
+static struct endpoint **setupendpoints(struct endpoint **, char **);
+static struct endpoint **duejobs(struct endpoint **, time_t *);
+static time_t setwindow(time_t);
+static void runbatch(struct endpoint **);
+static void rundaemon(struct endpoint **, const char *, char **);
+static void startmux(struct endpoint **);
+static void stopmux(struct endpoint **);
+
+/* Self-pipe to notify the main loop of exited children. */
+static int chldfd[2] = { -1, -1 };
+
+/*
+ * An ssh control master that is shared by all locations with the same local
+ * user, remote user and host.
+ */
+struct mux {
+	const struct endpoint *ep;	/* first endpoint of the group */
+	char *ctlpath;	/* path of the control socket */
+	int fd;	/* communication channel, closed to stop the helper */
+	pid_t pid;	/* process id of the helper, -1 if reaped */
+};
+
+/* Control masters of the current run. */
+static struct mux *muxv;
+static size_t muxvlen;
+
+/* Set by SIGHUP in daemon mode. */
+static volatile sig_atomic_t reloadreq = 0;
+
+/* All endpoints of the config, a run only processes the due ones. */
+static struct endpoint **cfgepv = NULL;
+
 /*
  * Communication with the other processes is as follows:
  *
@@ -70,6 +140,11 @@ void print_usage(FILE *);
  *			signal postexec to stop
  *	wait for rotator exit
  *
+ * The above is done for up to maxjobs locations at the same time. Whenever a
+ * location is done, the next location is started. The master never blocks on
+ * one location, it multiplexes the communication channels of all locations and
+ * the exit of children using poll(2) and a self-pipe for SIGCHLD.
+ *
  * rotator (trusted):
  *	ensure root
  *	obtain a lock (might be locked by an older rotator)
@@ -88,10 +163,10 @@ void print_usage(FILE *);
 int
 main(int argc, char *argv[])
 {
-	struct endpoint **epv;
-	int cmd, c, n, commfd[2], i, **rsyncexit, trusted, exists, updated;
-	char *cfgfile, *hostid, **filters, **cpp;
-	mode_t relax, mode;
+	struct endpoint **epv, **batch;
+	int c;
+	const char *errstr;
+	char *cfgfile, **filters;
 	extern int opterr;
 
 	if ((starttime = time(NULL)) == -1)
@@ -101,18 +176,27 @@ main(int argc, char *argv[])
 	filters = NULL;
 
 	opterr = 0;
-	while ((c = getopt(argc, argv, "c:fhnqs:vV")) != -1)
+	while ((c = getopt(argc, argv, "c:dfhj:nqs:vV")) != -1)
 		switch(c) {
 		case 'c':
 			if ((cfgfile = strdup(optarg)) == NULL)
 				err(1, "strdup");
 			break;
+		case 'd':
+			daemonopt = 1;
+			break;
 		case 'f':
 			forceopt = 1;
 			break;
 		case 'h':
 			helpopt = 1;
 			break;
+		case 'j':
+			jobsopt = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of jobs is %s: %s", errstr,
+					optarg);
+			break;
 		case 'n':
 			cfgcheckonly = 1;
 			break;
@@ -161,35 +245,8 @@ main(int argc, char *argv[])
 		if ((cfgfile = strdup(CONFIGFILE)) == NULL)
 			err(1, "strdup");
 
-	/*
-	 * Check owner and permissions of the config file. It should be owned by
-	 * the superuser and wheel. It's ok if it's readable by wheel.
-	 */
-
-	if (trustedpath(cfgfile, S_IRGRP, 0, &trusted, &exists) == -1)
-		err(1, "%s: trustedpath", __func__);
-
-	if (trusted && !exists) {
-		errno = ENOENT;
-		err(1, "%s", cfgfile);
-	}
-
-	if (!trusted) {
-		errx(1, "%s untrusted.\nAcceptable ownership and permissions: "
-			"root:wheel rw-r-----.\n"
-			"Furthermore all path components leading up to the file"
-			" must be owned by the\nsuperuser and none should be "
-			"writable by the group or others.", cfgfile);
-	}
-
-	/* Open and parse config file. */
-
-	if ((n = open(cfgfile, O_RDONLY | O_CLOEXEC)) == -1)
-		err(1, "%s", cfgfile);
-	if ((epv = parseconfig(n)) == NULL)
+	if ((epv = readconfig(cfgfile)) == NULL)
 		errx(0, "no hosts to backup");
-	if (close(n) == -1)
-		err(1, "%s: close", __func__);
 
 	if (cfgcheckonly) {
 		if (verbose > -1)
@@ -199,8 +256,8 @@ main(int argc, char *argv[])
 		exit(0);
 	}
 
-	free(cfgfile);
-	cfgfile = NULL;
+	if (jobsopt > 0)
+		maxjobs = jobsopt;
 
 	if (close(STDIN_FILENO) == -1)
 		err(1, "%s: close", __func__);
@@ -222,6 +279,126 @@ main(int argc, char *argv[])
 	/* Defaut to confidentiality and integrity. */
 	umask(077);
 
+	epv = setupendpoints(epv, filters);
+	cfgepv = epv;
+
+	if (daemonopt)
+		rundaemon(epv, cfgfile, filters);
+
+	free(cfgfile);
+	cfgfile = NULL;
+	clrstrv(&filters);
+
+	/* Determine when the backup window closes while the timezone is known. */
+	if (setwindow(starttime) != 0) {
+		if (verbose > 0)
+			fprintf(stdout, "backup window is closed\n");
+		return 0;
+	}
+
+	/*
+	 * Skip locations for which no new snapshot is due before any process is
+	 * forked for them. Run the rotators and syncers of up to maxjobs backup
+	 * hosts at the same time, within the backup window. The master chroots
+	 * and pledges as soon as all processes are forked.
+	 */
+
+	batch = duejobs(epv, NULL);
+	runjobs(batch);
+	free(batch);
+
+	return 0;
+}
+
+void
+print_usage(FILE *fp)
+{
+	fprintf(fp, "usage: %s [-dfhnqvV] [-c configfile] [-j jobs] [-s filter]\n", getprogname());
+}
+
+/*
+ * Check owner and permissions of the config file and parse it.
+ *
+ * Return the configured endpoints, or NULL if there are none.
+ */
+static struct endpoint **
+readconfig(const char *cfgfile)
+{
+	struct endpoint **epv;
+	int fd, trusted, exists;
+
+	/*
+	 * The config file should be owned by the superuser and wheel. It's ok
+	 * if it's readable by wheel.
+	 */
+
+	if (trustedpath(cfgfile, S_IRGRP, 0, &trusted, &exists) == -1)
+		err(1, "%s: trustedpath", __func__);
+
+	if (trusted && !exists) {
+		errno = ENOENT;
+		err(1, "%s", cfgfile);
+	}
+
+	if (!trusted) {
+		errx(1, "%s untrusted.\nAcceptable ownership and permissions: "
+			"root:wheel rw-r-----.\n"
+			"Furthermore all path components leading up to the file"
+			" must be owned by the\nsuperuser and none should be "
+			"writable by the group or others.", cfgfile);
+	}
+
+	/* Open and parse config file. */
+
+	if ((fd = open(cfgfile, O_RDONLY | O_CLOEXEC)) == -1)
+		err(1, "%s", cfgfile);
+	epv = parseconfig(fd);
+	if (close(fd) == -1)
+		err(1, "%s: close", __func__);
+
+	return epv;
+}
+
+/*
+ * Parse "cfgfile" in a child process, so that a config with errors does not
+ * take down a running daemon.
+ *
+ * Return 0 if the config can be loaded, -1 otherwise.
+ */
+static int
+checkconfig(const char *cfgfile)
+{
+	pid_t pid;
+
+	/* Don't let the child flush anything that is still buffered. */
+	if (fflush(stdout) == EOF)
+		err(1, "%s: fflush", __func__);
+
+	if ((pid = fork()) == -1) {
+		warn("%s: fork", __func__);
+		return -1;
+	}
+
+	if (pid == 0) {
+		(void)readconfig(cfgfile);
+		exit(0);
+	}
+
+	return reapproc(pid) == 0 ? 0 : -1;
+}
+
+/*
+ * Prepare the endpoints of a freshly parsed config.
+ *
+ * Return the endpoints that can be processed.
+ */
+static struct endpoint **
+setupendpoints(struct endpoint **epv, char **filters)
+{
+	int n, trusted, exists, updated;
+	char *hostid, **cpp;
+	mode_t relax, mode;
+
 	/*
 	 * If one or more host filters are used, filter out any hosts that don't
 	 * match any filter.
@@ -243,8 +420,6 @@ main(int argc, char *argv[])
 				n--;
 			}
 		}
-
-		clrstrv(&filters);
 	}
 
 	/*
@@ -312,7 +487,7 @@ main(int argc, char *argv[])
 
 		if (secureensuredir(epv[n]->root, mode, epv[n]->shared,
 		    &updated) == -1)
-			return -1;
+			err(1, "%s: secureensuredir", getepid(epv[n]));
 
 		if (updated)
 			warnx("%s: updated ownership and permissions of \"%s\"",
@@ -356,7 +531,7 @@ main(int argc, char *argv[])
 
 		if (secureensuredir(epv[n]->path, mode, epv[n]->shared,
 		    &updated) == -1)
-			return -1;
+			err(1, "%s: secureensuredir", getepid(epv[n]));
 
 		if (updated)
 			warnx("%s: updated ownership and permissions of \"%s\"",
@@ -365,369 +540,1724 @@ main(int argc, char *argv[])
 		n++;
 	}
 
-	/*
-	 * Pre-fork rotators and syncers.
-	 */
-
-	for (n = 0; epv[n] != NULL; n++) {
+	return epv;
+}
 
-		/*
-		 * Fork and start postexec if configured. Remove other endpoints
-		 * from the new address space.
-		 */
+/*
+ * Collect the endpoints for which a new snapshot is due at starttime, in the
+ * order of the configured schedule. This only reads the modification time of
+ * the first snapshot of the first interval.
+ *
+ * If "next" is not NULL, it is set to the earliest time at which one of the
+ * other endpoints is due, or 0 if there are none.
+ *
+ * Return a new null terminated vector that must be free(3)d. The endpoints
+ * themselves are still owned by "epv".
+ */
+static struct endpoint **
+duejobs(struct endpoint **epv, time_t *next)
+{
+	struct endpoint **batch;
+	struct stat st;
+	size_t nbatch;
+	time_t ttl, age, t;
+	int n, due;
+	char *tmp;
 
-		if (epv[n]->postexec != NULL) {
-			/* setup a communication channel to postexec  */
-			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
-			    AF_UNSPEC, commfd) == -1)
-				err(1, "could not setup a communication channel");
+	if (next)
+		*next = 0;
 
-			if ((epv[n]->poxpid = fork()) == -1)
-				err(1, "could not fork postexec");
+	batch = NULL;
+	nbatch = 0;
 
-			if (epv[n]->poxpid == 0) {
-				if (verbose > 1)
-					fprintf(stdout, "postexec[%d]: %s forked\n",
-						getpid(), getepid(epv[n]));
+	for (n = 0; epv[n] != NULL; n++) {
+		snaps_endpoint_openrootfd(epv[n]);
 
-				if (close(commfd[0]) == -1)
-					err(1, "closing peer side");
-				epv[n]->poxfd = commfd[1];
+		if (fstat(epv[n]->pathfd, &st) == -1)
+			err(1, "%s: fstat %s", __func__, epv[n]->path);
+		epv[n]->dev = st.st_dev;
 
-				/*
-				 * Open a file descriptor to the root dir to
-				 * work with.
-				 */
-				snaps_endpoint_openrootfd(epv[n]);
+		if ((due = snapshotdue(epv[n], starttime, &ttl, &age)) == -1)
+			err(1, "%s: snapshotdue", getepid(epv[n]));
 
-				/*
-				 * Remove other endpoints.
-				 */
+		/*
+		 * A location without any snapshot is more overdue than any
+		 * location with a snapshot.
+		 */
+		epv[n]->order = n;
+		if (ttl == 0 && age == 0)
+			epv[n]->overdue = starttime;
+		else
+			epv[n]->overdue = age - epv[n]->snapshots[0]->lifetime;
 
-				epv = snaps_keep_one_endpoint(epv, epv[n]);
+		epv[n]->expected = -1;
+		loadhistory(epv[n]);
 
-				setproctitle("postexec %s", getepid(epv[0]));
+		if (close(epv[n]->pathfd) == -1)
+			err(1, "%s: close", __func__);
+		epv[n]->pathfd = -1;
 
-				postexec(epv[0]);
+		t = starttime + ttl - TIMEPAD + 1;
 
-				errx(1, "unexpected return of postexec");
-			} else {
-				if (close(commfd[1]) == -1)
-					err(1, "closing peer side");
-				epv[n]->poxfd = commfd[0];
-			}
+		/* Don't retry a failed run of a daemon right away. */
+		if (epv[n]->lastrun > 0 && epv[n]->lastrun + RETRYWAIT > t) {
+			t = epv[n]->lastrun + RETRYWAIT;
+			due = t <= starttime;
 		}
 
-		/*
-		 * Fork and start a rotator. Remove other endpoints from the new
-		 * address space.
-		 */
-
-		/* setup a communication channel to the rotator */
-		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, AF_UNSPEC,
-		    commfd) == -1)
-			err(1, "could not setup a communication channel");
+		if (due || forceopt) {
+			batch = reallocarray(batch, nbatch + 1, sizeof(*batch));
+			if (batch == NULL)
+				err(1, "%s: reallocarray", __func__);
+			batch[nbatch++] = epv[n];
+			continue;
+		}
 
-		if ((epv[n]->rotpid = fork()) == -1)
-			err(1, "could not fork rotator");
+		if (next && (*next == 0 || t < *next))
+			*next = t;
+
+		if (verbose > 0) {
+			if ((tmp = strdup(humanduration(age))) == NULL)
+				err(1, "%s: strdup", __func__);
+			fprintf(stdout, "  %s %s left (%s old)\n",
+				getepid(epv[n]), humanduration(t - starttime),
+				tmp);
+			free(tmp);
+			tmp = NULL;
+		}
+	}
 
-		if (epv[n]->rotpid == 0) {
-			if (verbose > 1)
-				fprintf(stdout, "rotator[%d]: %s forked\n",
-					getpid(), getepid(epv[n]));
+	if ((batch = reallocarray(batch, nbatch + 1, sizeof(*batch))) == NULL)
+		err(1, "%s: reallocarray", __func__);
+	batch[nbatch] = NULL;
 
-			/*
-			 * Close the communication channel with postexec if
-			 * there was any.
-			 */
+	if (schedule == SCHEDOVERDUE)
+		qsort(batch, nbatch, sizeof(*batch), cmpoverdue);
+	else if (schedule == SCHEDLONGEST)
+		qsort(batch, nbatch, sizeof(*batch), cmplongest);
 
-			if (epv[n]->postexec != NULL) {
-				if (close(epv[n]->poxfd) == -1)
-					err(1, "close communication channel to "
-						"postexec in the rotator");
-				epv[n]->poxfd = -1;
-			}
+	return batch;
+}
 
-			if (close(commfd[0]) == -1)
-				err(1, "closing peer side");
-			epv[n]->rotfd = commfd[1];
+/*
+ * Set the time at which the backup window that is open at time "t" closes.
+ *
+ * Return 0 if the window is open at time "t", or the time at which it opens
+ * next.
+ */
+static time_t
+setwindow(time_t t)
+{
+	time_t opens;
 
-			/*
-			 * Open a file descriptor to the root dir to
-			 * work with.
-			 */
-			snaps_endpoint_openrootfd(epv[n]);
+	windowclose = 0;
 
-			/*
-			 * Remove other endpoints.
-			 */
+	if (windowend == -1)
+		return 0;
 
-			epv = snaps_keep_one_endpoint(epv, epv[n]);
+	windowclose = nexttimeofday(t, windowend);
 
-			setproctitle("rotator %s", getepid(epv[0]));
+	if (windowstart == -1)
+		return 0;
 
-			rotator(epv[0], starttime, forceopt);
+	/* The window is closed if it opens before it closes. */
+	opens = nexttimeofday(t, windowstart);
+	if (opens < windowclose)
+		return opens;
 
-			errx(1, "unexpected return of rotator");
-		} else {
-			if (close(commfd[1]) == -1)
-				err(1, "closing peer side");
-			epv[n]->rotfd = commfd[0];
-		}
+	return 0;
+}
 
-		/*
-		 * Fork and start a syncer process. Remove other endpoints from
-		 * the new address space.
-		 */
+/*
+ * Request a reload of the config and wake up the main loop if it is running
+ * jobs.
+ */
+static void
+sighup(int sig)
+{
+	int saved_errno;
 
-		/* setup a communication channel to the syncer process */
-		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, AF_UNSPEC,
-		    commfd) == -1)
-			err(1, "could not setup a communication channel");
+	(void)sig;
 
-		if ((epv[n]->synpid = fork()) == -1)
-			err(1, "could not fork syncer");
+	reloadreq = 1;
 
-		if (epv[n]->synpid == 0) {
-			if (verbose > 1)
-				fprintf(stdout, "syncer[%d]: %s forked\n",
-					getpid(), getepid(epv[n]));
+	saved_errno = errno;
+	if (chldfd[1] != -1)
+		(void)write(chldfd[1], "", 1);
+	errno = saved_errno;
+}
 
-			/*
-			 * Close the communication channel with postexec if
-			 * there was any.
-			 */
+/*
+ * Run "batch" in a new master, so that it can chroot and pledge itself like a
+ * single run while the daemon keeps access to all locations. A reload request
+ * is forwarded so that the new master skips the endpoints that are pending.
+ *
+ * The new master reports the endpoints that failed by their position in
+ * "batch", counting from one. If it does not exit cleanly, all endpoints are
+ * marked as failed.
+ */
+static void
+runbatch(struct endpoint **batch)
+{
+	struct pollfd pfd;
+	sigset_t hupmask, omask;
+	pid_t pid;
+	int n, nbatch, cmd, hupsent, fds[2];
 
-			if (epv[n]->postexec != NULL) {
-				if (close(epv[n]->poxfd) == -1)
-					err(1, "close communication channel to "
-						"postexec in the syncer");
-				epv[n]->poxfd = -1;
-			}
+	for (nbatch = 0; batch[nbatch] != NULL; nbatch++)
+		;
 
-			/*
-			 * Open a file descriptor to the root dir to
-			 * work with.
-			 */
-			snaps_endpoint_openrootfd(epv[n]);
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		err(1, "%s: pipe2", __func__);
 
-			/*
-			 * Close the communication channel with the rotator.
-			 */
+	/* Don't let the child flush anything that is still buffered. */
+	if (fflush(stdout) == EOF)
+		err(1, "%s: fflush", __func__);
 
-			if (close(epv[n]->rotfd) == -1)
-				err(1, "close communication channel to the "
-					"rotator in the syncer");
-			epv[n]->rotfd = -1;
+	if ((pid = fork()) == -1)
+		err(1, "%s: fork", __func__);
 
-			/*
-			 * Setup communication channel.
-			 */
+	if (pid == 0) {
+		if (close(fds[0]) == -1)
+			err(1, "%s: close", __func__);
 
-			if (close(commfd[0]) == -1)
-				err(1, "closing peer side");
-			epv[n]->synfd = commfd[1];
+		runjobs(batch);
 
-			/*
-			 * Remove other endpoints.
-			 */
+		for (n = 0; n < nbatch; n++) {
+			if (!batch[n]->failed)
+				continue;
+			while (writecmd(fds[1], n + 1) == -1)
+				if (errno != EINTR)
+					err(1, "%s: writecmd", __func__);
+		}
 
-			epv = snaps_keep_one_endpoint(epv, epv[n]);
+		exit(0);
+	}
 
-			setproctitle("syncer %s", getepid(epv[0]));
+	if (close(fds[1]) == -1)
+		err(1, "%s: close", __func__);
 
-			syncer(epv[0]);
+	/* Only let SIGHUP interrupt ppoll(2), see rundaemon(). */
+	sigemptyset(&hupmask);
+	sigaddset(&hupmask, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &hupmask, &omask) == -1)
+		err(1, "%s: sigprocmask", __func__);
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	hupsent = 0;
+
+	for (;;) {
+		if (reloadreq && !hupsent) {
+			if (kill(pid, SIGHUP) == -1)
+				warn("%s: kill %d", __func__, pid);
+			hupsent = 1;
+		}
 
-			errx(1, "unexpected return of syncer");
-		} else {
-			if (close(commfd[1]) == -1)
-				err(1, "closing peer side");
-			epv[n]->synfd = commfd[0];
+		if (ppoll(&pfd, 1, NULL, &omask) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "%s: ppoll", __func__);
 		}
-	}
 
-	/*
-	 * Chroot, pledge and wait for the first rotator to be ready, signal the
-	 * accompanying syncer to start, repeat for each backup host, one after
-	 * the other.
-	 */
+		if (readcmd(fds[0], &cmd) == -1)
+			err(1, "%s: readcmd", __func__);
+		if (cmd == CMDCLOSED)
+			break;
 
-	if (chroot(EMPTYDIR) == -1 || chdir("/") == -1)
-		err(1, "%s: chroot %s", __func__, EMPTYDIR);
-	if (pledge("stdio", NULL) == -1)
-		err(1, "%s: pledge", __func__);
+		if (cmd < 1 || cmd > nbatch)
+			errx(1, "%s: unknown endpoint %d", __func__, cmd);
+		batch[cmd - 1]->failed = 1;
+	}
 
-	for (n = 0; epv[n] != NULL; n++) {
-		/*
-		 * Signal the rotator to start and wait for it to signal it's
-		 * ready or done.
-		 */
+	if (sigprocmask(SIG_SETMASK, &omask, NULL) == -1)
+		err(1, "%s: sigprocmask", __func__);
 
-		if (writecmd(epv[n]->rotfd, CMDSTART) == -1)
-			err(1, "%s: write rotator start signal",
-				getepid(epv[n]));
-		if (readcmd(epv[n]->rotfd, &cmd) == -1)
-			err(1, "%s: rotator read error", getepid(epv[n]));
+	if (close(fds[0]) == -1)
+		err(1, "%s: close", __func__);
 
-		if (cmd != CMDCLOSED && cmd != CMDREADY)
-			err(1, "%s: unexpected signal from rotator %d",
-				getepid(epv[n]), cmd);
+	if (reapproc(pid) != 0)
+		for (n = 0; n < nbatch; n++)
+			batch[n]->failed = 1;
+}
 
-		/*
-		 * Signal the syncer to either start or stop, same with postexec
-		 * if it is running.
-		 */
+/*
+ * Keep running and start the endpoints as soon as a new snapshot is due. On
+ * SIGHUP, let running jobs finish and reload the config. Never returns.
+ *
+ * The daemon itself can not chroot or pledge since it needs to access all
+ * locations and fork a new master for every run. Every run is done by such a
+ * master, which sandboxes itself like a single run.
+ */
+static void
+rundaemon(struct endpoint **epv, const char *cfgfile, char **filters)
+{
+	struct sigaction sa;
+	struct endpoint **batch, **epp;
+	struct timespec ts;
+	sigset_t hupmask, omask;
+	time_t next, now;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sighup;
+	if (sigaction(SIGHUP, &sa, NULL) == -1)
+		err(1, "%s: sigaction", __func__);
+
+	sigemptyset(&hupmask);
+	sigaddset(&hupmask, SIGHUP);
+
+	for (;;) {
+		if (reloadreq) {
+			reloadreq = 0;
+
+			if (verbose > -1)
+				fprintf(stdout, "reloading %s\n", cfgfile);
+
+			if (checkconfig(cfgfile) == -1) {
+				warnx("%s: keeping the previous config",
+					cfgfile);
+			} else {
+				for (epp = epv; epp && *epp; epp++)
+					snaps_free_endpoint(epp);
+				free(epv);
 
-		if (cmd == CMDREADY) {
-			if (writecmd(epv[n]->synfd, CMDSTART) == -1)
-				err(1, "%s: write syncer start signal",
-					getepid(epv[n]));
+				if ((epv = readconfig(cfgfile)) == NULL)
+					warnx("no hosts to backup");
+				else
+					epv = setupendpoints(epv, filters);
 
-			if (close(epv[n]->synfd) == -1)
-				err(1, "%s: closing communication channel to syncer",
-					getepid(epv[n]));
-			epv[n]->synfd = -1;
+				cfgepv = epv;
 
-			if ((i = reapproc(epv[n]->synpid)) == -1)
-				errx(1, "%s: reap syncer error", getepid(epv[n]));
+				if (jobsopt > 0)
+					maxjobs = jobsopt;
+			}
+		}
 
-			if (verbose > 1)
-				fprintf(stdout, "%s: syncer[%d] exit %d\n",
-					getepid(epv[n]), epv[n]->synpid, i);
+		if ((starttime = time(NULL)) == -1)
+			err(1, "could not determine current time");
 
-			/*
-			 * Signal postexec the syncer exit status or -1 if an error
-			 * occurred, close the communication channel and wait until it's
-			 * done.
-			 */
+		next = setwindow(starttime);
 
-			if (epv[n]->postexec != NULL) {
-				if (writecmd(epv[n]->poxfd, CMDCUST) == -1)
-					err(1, "%s: write postexec custom signal",
-						getepid(epv[n]));
-				if (writecmd(epv[n]->poxfd, i) == -1)
-					err(1, "%s: write postexec syncer exit status",
-						getepid(epv[n]));
-				if (close(epv[n]->poxfd) == -1)
-					err(1, "%s: closing communication channel to postexec",
-						getepid(epv[n]));
-				if ((i = reapproc(epv[n]->poxpid)) == -1)
-					errx(1, "%s: reap postexec error", getepid(epv[n]));
-				if (verbose > 1)
-					fprintf(stdout, "%s: postexec[%d] exit %d\n",
-						getepid(epv[n]), epv[n]->poxpid, i);
-				epv[n]->poxpid = -1;
-			}
+		if (next == 0 && epv != NULL) {
+			batch = duejobs(epv, &next);
 
-			/*
-			 * Depending on the termination status of the syncer or
-			 * postexec if configured, signal the rotator to either
-			 * cleanup, or rollin the new snapshot.
-			 */
+			if (*batch != NULL) {
+				runbatch(batch);
 
-			if (epv[n]->postexec == NULL) {
-
-				/*
-				 * i contains the rsync exit status, see if it
-				 * indicates success.
-				 */
-
-				if (i != 0 && epv[n]->rsyncexit) {
-					for (rsyncexit = epv[n]->rsyncexit;
-					    *rsyncexit; rsyncexit++) {
-						if (i == **rsyncexit) {
-							i = 0;
-							break;
-						}
-					}
+				/* Only retry failed endpoints after a while. */
+				for (epp = batch; *epp; epp++) {
+					(*epp)->state = EPNEW;
+					(*epp)->deadline = 0;
+					(*epp)->overrun = 0;
+					(*epp)->lastrun = (*epp)->failed ?
+						starttime : 0;
+					(*epp)->failed = 0;
 				}
 
-				if (i != 0)
-					warnx("%s: syncer[%d] exit %d",
-						getepid(epv[n]), epv[n]->synpid, i);
-			}
-
-			epv[n]->synpid = -1;
+				/* Only force the first run. */
+				forceopt = 0;
 
-			if (i == 0) {
-				if (writecmd(epv[n]->rotfd, CMDROTINCLUDE) == -1)
-					err(1, "%s: write rotator signal",
-						getepid(epv[n]));
-			} else {
-				if (writecmd(epv[n]->rotfd, CMDROTCLEANUP) == -1)
-					err(1, "%s: write rotator signal",
-						getepid(epv[n]));
+				free(batch);
+				continue;
 			}
-		} else {
-			/*
-			 * Signal the syncer and optionally postexec to stop.
-			 * Close communication channels after sending the signal
-			 * and reap.
-			 */
 
-			/* First the syncer. */
-			if (writecmd(epv[n]->synfd, CMDSTOP) == -1)
-				err(1, "%s: write syncer stop signal",
-					getepid(epv[n]));
-			if (close(epv[n]->synfd) == -1)
-				err(1, "%s: closing communication channel to syncer",
-					getepid(epv[n]));
-			epv[n]->synfd = -1;
-			if ((i = reapproc(epv[n]->synpid)) == -1)
-				errx(1, "%s: reap syncer error", getepid(epv[n]));
-			if (verbose > 1)
-				fprintf(stdout, "%s: syncer[%d] exit %d\n",
-					getepid(epv[n]), epv[n]->synpid, i);
-			epv[n]->synpid = -1;
-
-			/* Then postexec, if configured. */
-			if (epv[n]->postexec != NULL) {
-				if (writecmd(epv[n]->poxfd, CMDSTOP) == -1)
-					err(1, "%s: write postexec stop signal",
-						getepid(epv[n]));
-				if (close(epv[n]->poxfd) == -1)
-					err(1, "%s: closing communication channel to postexec",
-						getepid(epv[n]));
-				if ((i = reapproc(epv[n]->poxpid)) == -1)
-					errx(1, "%s: reap postexec error", getepid(epv[n]));
-				if (verbose > 1)
-					fprintf(stdout, "%s: postexec[%d] exit %d\n",
-						getepid(epv[n]), epv[n]->poxpid, i);
-				epv[n]->poxpid = -1;
-			}
+			free(batch);
 		}
 
 		/*
-		 * At last the rotator. It signalled us it was done or we
-		 * signalled it to finish up, so no need to send the stop
-		 * signal. It should already have exited. Close the
-		 * communication-channel with the rotator and reap.
+		 * Sleep until the next endpoint is due, or the window opens.
+		 * Block SIGHUP while checking for a reload request so that it
+		 * can only be delivered while sleeping.
 		 */
 
-		if (close(epv[n]->rotfd) == -1)
-			warn("%s: closing communication channel to rotator",
-				getepid(epv[n]));
-		epv[n]->rotfd = -1;
+		if (sigprocmask(SIG_BLOCK, &hupmask, &omask) == -1)
+			err(1, "%s: sigprocmask", __func__);
 
-		if ((i = reapproc(epv[n]->rotpid)) == -1)
-			errx(1, "%s: rotator[%d] reap rotator error",
-				getepid(epv[n]), epv[n]->rotpid);
+		if (!reloadreq) {
+			if ((now = time(NULL)) == -1)
+				err(1, "could not determine current time");
 
-		if (verbose > 1)
-			fprintf(stdout, "%s: rotator[%d] exit %d\n",
-				getepid(epv[n]), epv[n]->rotpid, i);
+			ts.tv_sec = next - now;
+			ts.tv_nsec = 0;
+
+			if (next == 0 || ts.tv_sec > 0)
+				if (ppoll(NULL, 0, next == 0 ? NULL : &ts,
+				    &omask) == -1 && errno != EINTR)
+					err(1, "%s: ppoll", __func__);
+		}
 
-		if (i != 0)
-			warnx("%s: rotator[%d] exit %d",
-				getepid(epv[n]), epv[n]->rotpid, i);
-		epv[n]->rotpid = -1;
+		if (sigprocmask(SIG_SETMASK, &omask, NULL) == -1)
+			err(1, "%s: sigprocmask", __func__);
 	}
+}
 
-	return 0;
+/*
+ * Signal SIGCHLD to the main loop via the self-pipe.
+ */
+static void
+sigchld(int sig)
+{
+	int saved_errno;
+
+	(void)sig;
+
+	saved_errno = errno;
+	(void)write(chldfd[1], "", 1);
+	errno = saved_errno;
 }
 
-void
-print_usage(FILE *fp)
+/*
+ * Write a command to one of the processes of an endpoint.
+ *
+ * Return 0 on success or -1 if the process is gone.
+ */
+static int
+epwritecmd(const struct endpoint *ep, int fd, int cmd, const char *proc)
 {
-	fprintf(fp, "usage: %s [-fhnqvV] [-c configfile] [-s filter]\n", getprogname());
+	if (writecmd(fd, cmd) == -1) {
+		if (errno != EPIPE)
+			err(1, "%s: write %s signal", getepid(ep), proc);
+
+		warnx("%s: %s is gone", getepid(ep), proc);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Close one of the communication channels of an endpoint, if open.
+ */
+static void
+epclose(const struct endpoint *ep, int *fd, const char *proc)
+{
+	if (*fd == -1)
+		return;
+
+	if (close(*fd) == -1)
+		warn("%s: closing communication channel to %s", getepid(ep),
+			proc);
+	*fd = -1;
+}
+
+/*
+ * Return whether the processes of an endpoint are forked but the syncer is not
+ * started yet.
+ */
+static int
+notstarted(const struct endpoint *ep)
+{
+	return ep->state == EPSTAGEWAIT || ep->state == EPPRESTAGING ||
+	    ep->state == EPQUEUED || ep->state == EPSTARTING;
+}
+
+/*
+ * Signal the syncer and optionally postexec to stop and close all
+ * communication channels. Wait for all processes to exit.
+ */
+static void
+stopjob(struct endpoint *ep)
+{
+	if (ep->synfd != -1)
+		(void)epwritecmd(ep, ep->synfd, CMDSTOP, "syncer");
+	epclose(ep, &ep->synfd, "syncer");
+
+	if (ep->poxfd != -1)
+		(void)epwritecmd(ep, ep->poxfd, CMDSTOP, "postexec");
+	epclose(ep, &ep->poxfd, "postexec");
+
+	/*
+	 * If the rotator did not start yet, signal it to stop, otherwise it
+	 * signalled us it was done, so no need to send the stop signal.
+	 */
+
+	if ((ep->state == EPSTAGEWAIT || ep->state == EPQUEUED) &&
+	    ep->rotfd != -1)
+		(void)epwritecmd(ep, ep->rotfd, CMDSTOP, "rotator");
+	epclose(ep, &ep->rotfd, "rotator");
+
+	ep->deadline = 0;
+	ep->state = EPFINISHING;
+}
+
+/*
+ * Undo the signal setup and close the self-pipe of the master in a new child.
+ */
+static void
+childinit(void)
+{
+	struct sigaction sa;
+	size_t n;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = SIG_DFL;
+	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+		err(1, "%s: sigaction", __func__);
+	if (sigaction(SIGPIPE, &sa, NULL) == -1)
+		err(1, "%s: sigaction", __func__);
+	if (sigaction(SIGHUP, &sa, NULL) == -1)
+		err(1, "%s: sigaction", __func__);
+
+	if (chldfd[0] != -1) {
+		if (close(chldfd[0]) == -1 || close(chldfd[1]) == -1)
+			err(1, "%s: close", __func__);
+		chldfd[0] = chldfd[1] = -1;
+	}
+
+	for (n = 0; n < muxvlen; n++) {
+		if (muxv[n].fd == -1)
+			continue;
+		if (close(muxv[n].fd) == -1)
+			err(1, "%s: close", __func__);
+		muxv[n].fd = -1;
+	}
+}
+
+/*
+ * Remove all endpoints but "ep" from the address space of a new child, also
+ * the ones of the config that are not in "batch". The endpoints of "batch"
+ * are owned by the config.
+ *
+ * Return a new vector that only contains "ep".
+ */
+static struct endpoint **
+keependpoint(struct endpoint **batch, struct endpoint *ep)
+{
+	if (batch != cfgepv)
+		free(batch);
+
+	return snaps_keep_one_endpoint(cfgepv, ep);
+}
+
+/*
+ * Fork the rotator, syncer and optionally postexec of an endpoint. Each child
+ * removes the other endpoints from its address space.
+ */
+static void
+forkjob(struct endpoint **epv, struct endpoint *ep)
+{
+	int commfd[2];
+
+	/*
+	 * Fork and start postexec if configured. Remove other endpoints
+	 * from the new address space.
+	 */
+
+	if (ep->postexec != NULL) {
+		/* setup a communication channel to postexec  */
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+		    AF_UNSPEC, commfd) == -1)
+			err(1, "could not setup a communication channel");
+
+		if ((ep->poxpid = fork()) == -1)
+			err(1, "could not fork postexec");
+
+		if (ep->poxpid == 0) {
+			childinit();
+
+			if (verbose > 1)
+				fprintf(stdout, "postexec[%d]: %s forked\n",
+					getpid(), getepid(ep));
+
+			if (close(commfd[0]) == -1)
+				err(1, "closing peer side");
+			ep->poxfd = commfd[1];
+
+			/*
+			 * Open a file descriptor to the root dir to
+			 * work with.
+			 */
+			snaps_endpoint_openrootfd(ep);
+
+			/*
+			 * Remove other endpoints.
+			 */
+
+			epv = keependpoint(epv, ep);
+
+			setproctitle("postexec %s", getepid(epv[0]));
+
+			postexec(epv[0]);
+
+			errx(1, "unexpected return of postexec");
+		} else {
+			if (close(commfd[1]) == -1)
+				err(1, "closing peer side");
+			ep->poxfd = commfd[0];
+		}
+	}
+
+	/*
+	 * Fork and start a rotator. Remove other endpoints from the new
+	 * address space.
+	 */
+
+	/* setup a communication channel to the rotator */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, AF_UNSPEC,
+	    commfd) == -1)
+		err(1, "could not setup a communication channel");
+
+	if ((ep->rotpid = fork()) == -1)
+		err(1, "could not fork rotator");
+
+	if (ep->rotpid == 0) {
+		childinit();
+
+		if (verbose > 1)
+			fprintf(stdout, "rotator[%d]: %s forked\n",
+				getpid(), getepid(ep));
+
+		/*
+		 * Close the communication channel with postexec if
+		 * there was any.
+		 */
+
+		if (ep->postexec != NULL) {
+			if (close(ep->poxfd) == -1)
+				err(1, "close communication channel to "
+					"postexec in the rotator");
+			ep->poxfd = -1;
+		}
+
+		if (close(commfd[0]) == -1)
+			err(1, "closing peer side");
+		ep->rotfd = commfd[1];
+
+		/*
+		 * Open a file descriptor to the root dir to
+		 * work with.
+		 */
+		snaps_endpoint_openrootfd(ep);
+
+		/*
+		 * Remove other endpoints.
+		 */
+
+		epv = keependpoint(epv, ep);
+
+		setproctitle("rotator %s", getepid(epv[0]));
+
+		rotator(epv[0], starttime, forceopt);
+
+		errx(1, "unexpected return of rotator");
+	} else {
+		if (close(commfd[1]) == -1)
+			err(1, "closing peer side");
+		ep->rotfd = commfd[0];
+	}
+
+	/*
+	 * Fork and start a syncer process. Remove other endpoints from
+	 * the new address space.
+	 */
+
+	/* setup a communication channel to the syncer process */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, AF_UNSPEC,
+	    commfd) == -1)
+		err(1, "could not setup a communication channel");
+
+	if ((ep->synpid = fork()) == -1)
+		err(1, "could not fork syncer");
+
+	if (ep->synpid == 0) {
+		childinit();
+
+		if (verbose > 1)
+			fprintf(stdout, "syncer[%d]: %s forked\n",
+				getpid(), getepid(ep));
+
+		/*
+		 * Close the communication channel with postexec if
+		 * there was any.
+		 */
+
+		if (ep->postexec != NULL) {
+			if (close(ep->poxfd) == -1)
+				err(1, "close communication channel to "
+					"postexec in the syncer");
+			ep->poxfd = -1;
+		}
+
+		/*
+		 * Open a file descriptor to the root dir to
+		 * work with.
+		 */
+		snaps_endpoint_openrootfd(ep);
+
+		/*
+		 * Close the communication channel with the rotator.
+		 */
+
+		if (close(ep->rotfd) == -1)
+			err(1, "close communication channel to the "
+				"rotator in the syncer");
+		ep->rotfd = -1;
+
+		/*
+		 * Setup communication channel.
+		 */
+
+		if (close(commfd[0]) == -1)
+			err(1, "closing peer side");
+		ep->synfd = commfd[1];
+
+		/*
+		 * Remove other endpoints.
+		 */
+
+		epv = keependpoint(epv, ep);
+
+		setproctitle("syncer %s", getepid(epv[0]));
+
+		syncer(epv[0]);
+
+		errx(1, "unexpected return of syncer");
+	} else {
+		if (close(commfd[1]) == -1)
+			err(1, "closing peer side");
+		ep->synfd = commfd[0];
+	}
+
+	ep->state = ep->prestage ? EPSTAGEWAIT : EPQUEUED;
+}
+
+/*
+ * Signal the rotator of an endpoint to prepare the sync dir. The answer is
+ * handled by rotatorcmd.
+ */
+static void
+prestagejob(struct endpoint *ep)
+{
+	if (epwritecmd(ep, ep->rotfd, CMDPRESTAGE, "rotator") == -1) {
+		ep->failed = 1;
+		stopjob(ep);
+		return;
+	}
+
+	ep->state = EPPRESTAGING;
+}
+
+/*
+ * Signal the rotator of an endpoint to start. The answer is handled by
+ * rotatorcmd.
+ */
+static void
+startjob(struct endpoint *ep)
+{
+	if (epwritecmd(ep, ep->rotfd, CMDSTART, "rotator") == -1) {
+		ep->failed = 1;
+		stopjob(ep);
+		return;
+	}
+
+	memset(&ep->stats, 0, sizeof(ep->stats));
+	ep->syncstart = 0;
+	ep->state = EPSTARTING;
+}
+
+/*
+ * Depending on the termination status of the syncer or postexec if configured,
+ * signal the rotator to either cleanup, or rollin the new snapshot.
+ */
+static void
+finishjob(struct endpoint *ep, int status)
+{
+	if (status != 0)
+		ep->failed = 1;
+
+	if (ep->rotfd != -1) {
+		if (status == 0) {
+			/* Pass on the statistics for the history. */
+			if (epwritecmd(ep, ep->rotfd, CMDROTINCLUDE,
+			    "rotator") == 0 &&
+			    epwritecmd(ep, ep->rotfd, CMDSTATS,
+			    "rotator") == 0 &&
+			    writestats(ep->rotfd, &ep->stats) == -1)
+				warn("%s: rotator write error", getepid(ep));
+		} else
+			(void)epwritecmd(ep, ep->rotfd, CMDROTCLEANUP,
+				"rotator");
+	} else {
+		warnx("%s: rotator is gone, can not finish", getepid(ep));
+	}
+
+	epclose(ep, &ep->synfd, "syncer");
+	epclose(ep, &ep->poxfd, "postexec");
+	epclose(ep, &ep->rotfd, "rotator");
+
+	ep->state = EPFINISHING;
+}
+
+/*
+ * Print the transfer statistics of the last sync of an endpoint on one line as
+ * key=value pairs. Regular files that are not transferred are unchanged, and
+ * hard linked to a previous snapshot.
+ */
+static void
+printstats(const struct endpoint *ep)
+{
+	const struct xferstats *st;
+	double speedup;
+
+	st = &ep->stats;
+
+	speedup = 0;
+	if (st->sent + st->received > 0)
+		speedup = (double)st->size / (st->sent + st->received);
+
+	fprintf(stdout, "%s: files=%lld regular=%lld created=%lld "
+		"deleted=%lld transferred=%lld unchanged=%lld size=%lld "
+		"transferredsize=%lld literal=%lld matched=%lld sent=%lld "
+		"received=%lld elapsed=%lld speedup=%.2f\n", getepid(ep),
+		st->files, st->regfiles, st->created, st->deleted,
+		st->transferred, st->regfiles - st->transferred, st->size,
+		st->xfersize, st->literal, st->matched, st->sent, st->received,
+		st->elapsed, speedup);
+}
+
+/*
+ * Process the exit code of the syncer. Either pass it on to postexec or decide
+ * whether the new snapshot should be included.
+ */
+static void
+syncerdone(struct endpoint *ep, int i)
+{
+	int **rsyncexit;
+
+	/* Collect the statistics the syncer sent before it exited. */
+	while (ep->synfd != -1)
+		childcmd(ep, &ep->synfd, "syncer");
+
+	/*
+	 * The syncer is not trusted, so replace the time it reported with the
+	 * time from its start until now, which excludes postexec.
+	 */
+	ep->stats.elapsed = ep->syncstart > 0 ? time(NULL) - ep->syncstart :
+	    -1;
+
+	if (verbose > 0 && ep->stats.complete)
+		printstats(ep);
+
+	/* Never include a snapshot of a sync that was terminated. */
+
+	if (ep->overrun) {
+		if (ep->poxfd != -1)
+			(void)epwritecmd(ep, ep->poxfd, CMDSTOP, "postexec");
+		finishjob(ep, -1);
+		return;
+	}
+
+	/*
+	 * Signal postexec the syncer exit status, close the communication
+	 * channel and wait until it's done.
+	 */
+
+	if (ep->postexec != NULL) {
+		if (ep->poxfd == -1 ||
+		    epwritecmd(ep, ep->poxfd, CMDCUST, "postexec") == -1 ||
+		    epwritecmd(ep, ep->poxfd, i, "postexec") == -1) {
+			finishjob(ep, -1);
+			return;
+		}
+
+		ep->state = EPPOSTEXEC;
+		return;
+	}
+
+	/* i contains the rsync exit status, see if it indicates success. */
+
+	if (i != 0 && ep->rsyncexit) {
+		for (rsyncexit = ep->rsyncexit; *rsyncexit; rsyncexit++) {
+			if (i == **rsyncexit) {
+				i = 0;
+				break;
+			}
+		}
+	}
+
+	if (i != 0)
+		warnx("%s: syncer exit %d", getepid(ep), i);
+
+	finishjob(ep, i);
+}
+
+/*
+ * Handle a command, or the closing of the channel, from the rotator of an
+ * endpoint.
+ */
+static void
+rotatorcmd(struct endpoint *ep)
+{
+	int cmd;
+
+	if (readcmd(ep->rotfd, &cmd) == -1) {
+		warn("%s: rotator read error", getepid(ep));
+		cmd = -1;
+	}
+
+	if (ep->state == EPSTARTING && cmd == CMDREADY) {
+		/* Signal the syncer to start. */
+		if (epwritecmd(ep, ep->synfd, CMDSTART, "syncer") == -1) {
+			finishjob(ep, -1);
+			return;
+		}
+
+		ep->syncstart = time(NULL);
+		if (ep->maxruntime > 0)
+			ep->deadline = ep->syncstart + ep->maxruntime;
+
+		ep->state = EPSYNCING;
+		return;
+	}
+
+	if (ep->state == EPPRESTAGING && cmd == CMDREADY) {
+		/* The sync dir is prepared, wait for a free job slot. */
+		ep->state = EPQUEUED;
+		return;
+	}
+
+	if ((ep->state == EPPRESTAGING || ep->state == EPSTARTING) &&
+	    cmd == CMDCLOSED) {
+		/* The rotator is done, nothing to sync. */
+		stopjob(ep);
+		return;
+	}
+
+	if (cmd == CMDCLOSED)
+		warnx("%s: rotator closed the communication channel",
+			getepid(ep));
+	else if (cmd != -1)
+		warnx("%s: unexpected signal from rotator %d", getepid(ep),
+			cmd);
+
+	epclose(ep, &ep->rotfd, "rotator");
+
+	/*
+	 * If there is no rotator there is no use in running the syncer. If the
+	 * syncer is already running, let it finish.
+	 */
+
+	if (notstarted(ep)) {
+		ep->failed = 1;
+		stopjob(ep);
+	}
+}
+
+/*
+ * Handle the closing of the communication channel with the syncer or postexec.
+ * Normally this happens when the process executes its program, or when the
+ * syncer exits after it sent the transfer statistics. Anything else is
+ * unexpected.
+ */
+static void
+childcmd(struct endpoint *ep, int *fd, const char *proc)
+{
+	int cmd;
+
+	if (readcmd(*fd, &cmd) == -1) {
+		warn("%s: %s read error", getepid(ep), proc);
+		cmd = -1;
+	}
+
+	if (cmd == CMDSTATS && fd == &ep->synfd) {
+		if (readstats(*fd, &ep->stats) == 0)
+			return;
+
+		warn("%s: %s read error", getepid(ep), proc);
+		cmd = -1;
+	}
+
+	if (cmd != CMDCLOSED && cmd != -1)
+		warnx("%s: unexpected signal from %s %d", getepid(ep), proc,
+			cmd);
+
+	epclose(ep, fd, proc);
+
+	/* If the process is gone before it is started, give up. */
+	if (notstarted(ep)) {
+		warnx("%s: %s exited prematurely", getepid(ep), proc);
+		ep->failed = 1;
+		stopjob(ep);
+	}
+}
+
+/*
+ * Process the exit of one of the processes of an endpoint and advance the
+ * endpoint to the next state.
+ */
+static void
+procexit(struct endpoint *ep, pid_t pid, int i)
+{
+	if (pid == ep->rotpid) {
+		if (verbose > 1)
+			fprintf(stdout, "%s: rotator[%d] exit %d\n",
+				getepid(ep), pid, i);
+
+		if (i != 0) {
+			warnx("%s: rotator[%d] exit %d", getepid(ep), pid, i);
+			ep->failed = 1;
+		}
+
+		ep->rotpid = -1;
+	} else if (pid == ep->synpid) {
+		if (verbose > 1)
+			fprintf(stdout, "%s: syncer[%d] exit %d\n",
+				getepid(ep), pid, i);
+
+		ep->synpid = -1;
+
+		if (ep->state == EPSYNCING)
+			syncerdone(ep, i);
+	} else if (pid == ep->poxpid) {
+		if (verbose > 1)
+			fprintf(stdout, "%s: postexec[%d] exit %d\n",
+				getepid(ep), pid, i);
+
+		ep->poxpid = -1;
+
+		/* Never include a snapshot of a sync that was terminated. */
+		if (ep->state == EPPOSTEXEC)
+			finishjob(ep, ep->overrun ? -1 : i);
+	}
+
+	if (ep->state == EPFINISHING && ep->rotpid == -1 && ep->synpid == -1 &&
+	    ep->poxpid == -1)
+		ep->state = EPDONE;
+}
+
+/*
+ * Terminate the syncer or postexec of an endpoint that exceeded its maximum
+ * run time. The job is finished when the process exits, after which the
+ * rotator is signalled to cleanup the new snapshot. The syncer or postexec is
+ * killed if it is still running KILLWAIT seconds later, so that a process that
+ * ignores SIGTERM can not keep the run waiting forever.
+ */
+static void
+overrun(struct endpoint *ep)
+{
+	ep->deadline = 0;
+
+	if (ep->overrun) {
+		if (ep->state == EPSYNCING && ep->synpid != -1) {
+			warnx("%s: killing syncer[%d]", getepid(ep),
+				ep->synpid);
+			if (kill(ep->synpid, SIGKILL) == -1)
+				warn("%s: kill syncer[%d]", getepid(ep),
+					ep->synpid);
+		} else if (ep->state == EPPOSTEXEC && ep->poxpid != -1) {
+			warnx("%s: killing postexec[%d]", getepid(ep),
+				ep->poxpid);
+			if (kill(ep->poxpid, SIGKILL) == -1)
+				warn("%s: kill postexec[%d]", getepid(ep),
+					ep->poxpid);
+		}
+		return;
+	}
+
+	warnx("%s: exceeded maxruntime of %s", getepid(ep),
+		humanduration(ep->maxruntime));
+
+	ep->overrun = 1;
+
+	if (ep->state == EPSYNCING) {
+		/* syncerdone finishes the job when the syncer exits. */
+		if (ep->synpid != -1 && kill(ep->synpid, SIGTERM) == -1)
+			warn("%s: kill syncer[%d]", getepid(ep), ep->synpid);
+		ep->deadline = time(NULL) + KILLWAIT;
+	} else if (ep->state == EPPOSTEXEC) {
+		/* procexit finishes the job when postexec exits. */
+		if (ep->poxpid != -1 && kill(ep->poxpid, SIGTERM) == -1)
+			warn("%s: kill postexec[%d]", getepid(ep), ep->poxpid);
+		ep->deadline = time(NULL) + KILLWAIT;
+	}
+}
+
+/*
+ * Stop all endpoints that are not started yet, i.e. because the backup window
+ * is closed.
+ */
+static void
+skippending(struct endpoint **epv, const char *reason)
+{
+	for (; *epv; epv++) {
+		if ((*epv)->state == EPNEW) {
+			warnx("%s: %s", getepid(*epv), reason);
+			(*epv)->state = EPDONE;
+		} else if ((*epv)->state == EPSTAGEWAIT ||
+		    (*epv)->state == EPQUEUED) {
+			warnx("%s: %s", getepid(*epv), reason);
+			stopjob(*epv);
+		}
+	}
+}
+
+/*
+ * Lower a poll timeout in milliseconds so that poll returns at time "t".
+ *
+ * Return the new timeout.
+ */
+static int
+timeoutat(int timeout, time_t now, time_t t)
+{
+	time_t ms;
+
+	if (t <= now)
+		return 0;
+
+	ms = t - now;
+	if (ms > INT_MAX / 1000)
+		ms = INT_MAX / 1000;
+	ms *= 1000;
+
+	if (timeout == INFTIM || ms < timeout)
+		return ms;
+
+	return timeout;
+}
+
+/*
+ * Find the endpoint a child process belongs to.
+ *
+ * Return the endpoint on success or NULL if pid is not one of ours.
+ */
+static struct endpoint *
+findproc(struct endpoint **epv, pid_t pid)
+{
+	for (; *epv; epv++)
+		if ((*epv)->rotpid == pid || (*epv)->synpid == pid ||
+		    (*epv)->poxpid == pid)
+			return *epv;
+
+	return NULL;
+}
+
+/*
+ * Reap all children that exited.
+ */
+static void
+reapchildren(struct endpoint **epv)
+{
+	struct endpoint *ep;
+	size_t n;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(WAIT_ANY, &status, WNOHANG)) != 0) {
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ECHILD)
+				break;
+			err(1, "%s: waitpid", __func__);
+		}
+
+		if ((ep = findproc(epv, pid)) == NULL) {
+			for (n = 0; n < muxvlen; n++)
+				if (muxv[n].pid == pid)
+					break;
+
+			if (n < muxvlen) {
+				warnx("ssh control master of %s exited",
+					getepid(muxv[n].ep));
+				muxv[n].pid = -1;
+				continue;
+			}
+
+			warnx("%s: unknown child %d", __func__, pid);
+			continue;
+		}
+
+		procexit(ep, pid, exitcode(pid, status));
+	}
+}
+
+/*
+ * Start one ssh control master for every group of endpoints with sshmux set
+ * that share the same local user, remote user and host. Each endpoint is
+ * pointed to the control socket of its group. The socket is in a directory
+ * that is only accessible by the local user, so it can only be used by the
+ * syncers that would login with the same key anyway.
+ */
+static void
+startmux(struct endpoint **epv)
+{
+	struct endpoint **epp;
+	struct mux *mux;
+	size_t n;
+	int commfd[2];
+	char *dir;
+
+	for (epp = epv; *epp; epp++) {
+		if (!(*epp)->sshmux)
+			continue;
+
+		for (n = 0; n < muxvlen; n++)
+			if (muxv[n].ep->uid == (*epp)->uid &&
+			    strcmp(muxv[n].ep->ruser, (*epp)->ruser) == 0 &&
+			    strcmp(muxv[n].ep->hostname, (*epp)->hostname) == 0)
+				break;
+
+		if (n < muxvlen) {
+			(*epp)->sshctl = muxv[n].ctlpath;
+			continue;
+		}
+
+		if ((muxv = reallocarray(muxv, muxvlen + 1, sizeof(*muxv)))
+		    == NULL)
+			err(1, "%s: reallocarray", __func__);
+		mux = &muxv[muxvlen];
+
+		if ((dir = strdup(MUXDIR)) == NULL)
+			err(1, "%s: strdup", __func__);
+		if (mkdtemp(dir) == NULL)
+			err(1, "%s: mkdtemp %s", __func__, dir);
+		if (chown(dir, (*epp)->uid, (*epp)->gid) == -1)
+			err(1, "%s: chown %s", __func__, dir);
+		if (asprintf(&mux->ctlpath, "%s/%s", dir, MUXSOCK) <= 0)
+			err(1, "%s: asprintf", __func__);
+		free(dir);
+		dir = NULL;
+
+		mux->ep = *epp;
+		mux->fd = -1;
+		muxvlen++;
+
+		/* setup a communication channel to the control master */
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, AF_UNSPEC,
+		    commfd) == -1)
+			err(1, "could not setup a communication channel");
+
+		if ((mux->pid = fork()) == -1)
+			err(1, "could not fork ssh control master");
+
+		if (mux->pid == 0) {
+			/* closes the channels of previous control masters */
+			childinit();
+
+			if (close(commfd[0]) == -1)
+				err(1, "closing peer side");
+
+			epv = keependpoint(epv, *epp);
+
+			setproctitle("sshmux %s@%s", epv[0]->ruser,
+				epv[0]->hostname);
+
+			sshmux(epv[0], mux->ctlpath, commfd[1]);
+
+			errx(1, "unexpected return of sshmux");
+		}
+
+		if (close(commfd[1]) == -1)
+			err(1, "closing peer side");
+		mux->fd = commfd[0];
+
+		(*epp)->sshctl = mux->ctlpath;
+	}
+}
+
+/*
+ * Stop all ssh control masters by closing their communication channel and
+ * wait until they are cleaned up.
+ */
+static void
+stopmux(struct endpoint **epv)
+{
+	struct endpoint **epp;
+	size_t n;
+	int status;
+
+	for (epp = epv; *epp; epp++)
+		(*epp)->sshctl = NULL;
+
+	for (n = 0; n < muxvlen; n++) {
+		if (close(muxv[n].fd) == -1)
+			err(1, "%s: close", __func__);
+		muxv[n].fd = -1;
+	}
+
+	for (n = 0; n < muxvlen; n++) {
+		while (muxv[n].pid != -1 &&
+		    waitpid(muxv[n].pid, &status, 0) == -1)
+			if (errno != EINTR)
+				err(1, "%s: waitpid", __func__);
+
+		free(muxv[n].ctlpath);
+		muxv[n].ctlpath = NULL;
+	}
+
+	free(muxv);
+	muxv = NULL;
+	muxvlen = 0;
+}
+
+/*
+ * Add a file descriptor to the poll set and remember which endpoint it belongs
+ * to.
+ */
+static void
+addpollfd(struct pollfd *pfd, struct endpoint **pep, size_t *n,
+	struct endpoint *ep, int fd)
+{
+	if (fd == -1)
+		return;
+
+	pfd[*n].fd = fd;
+	pfd[*n].events = POLLIN;
+	pfd[*n].revents = 0;
+	pep[*n] = ep;
+	(*n)++;
+}
+
+/*
+ * Return the number of started or prestaging endpoints that are stored on
+ * device "dev".
+ */
+static int
+devactive(struct endpoint **epv, dev_t dev)
+{
+	int n;
+
+	n = 0;
+	for (; *epv; epv++)
+		if ((*epv)->dev == dev && (*epv)->state != EPNEW &&
+		    (*epv)->state != EPSTAGEWAIT &&
+		    (*epv)->state != EPQUEUED && (*epv)->state != EPDONE)
+			n++;
+
+	return n;
+}
+
+/*
+ * Return the number of started endpoints that are backups of "hostname".
+ */
+static int
+hostactive(struct endpoint **epv, const char *hostname)
+{
+	int n;
+
+	n = 0;
+	for (; *epv; epv++)
+		if (strcmp((*epv)->hostname, hostname) == 0 &&
+		    (*epv)->state != EPNEW && (*epv)->state != EPSTAGEWAIT &&
+		    (*epv)->state != EPPRESTAGING &&
+		    (*epv)->state != EPQUEUED && (*epv)->state != EPDONE)
+			n++;
+
+	return n;
+}
+
+/*
+ * Return the first time after "t" at which the local time of day is "min"
+ * minutes after midnight.
+ */
+static time_t
+nexttimeofday(time_t t, int min)
+{
+	struct tm *tm;
+	time_t r;
+
+	if ((tm = localtime(&t)) == NULL)
+		err(1, "%s: localtime", __func__);
+
+	tm->tm_hour = min / 60;
+	tm->tm_min = min % 60;
+	tm->tm_sec = 0;
+	tm->tm_isdst = -1;
+
+	if ((r = mktime(tm)) == -1)
+		err(1, "%s: mktime", __func__);
+
+	if (r <= t) {
+		tm->tm_mday++;
+		tm->tm_hour = min / 60;
+		tm->tm_min = min % 60;
+		tm->tm_isdst = -1;
+
+		if ((r = mktime(tm)) == -1)
+			err(1, "%s: mktime", __func__);
+	}
+
+	return r;
+}
+
+/*
+ * Order endpoints by overdue time, most overdue first. Fall back to the order
+ * of the config file.
+ */
+static int
+cmpoverdue(const void *a, const void *b)
+{
+	const struct endpoint *epa = *(struct endpoint * const *)a;
+	const struct endpoint *epb = *(struct endpoint * const *)b;
+
+	if (epa->overdue > epb->overdue)
+		return -1;
+	if (epa->overdue < epb->overdue)
+		return 1;
+
+	return epa->order - epb->order;
+}
+
+/*
+ * Order endpoints by the expected duration of the sync, longest first.
+ * Endpoints without history go first since their duration is unknown. Fall
+ * back to the order of the config file.
+ */
+static int
+cmplongest(const void *a, const void *b)
+{
+	const struct endpoint *epa = *(struct endpoint * const *)a;
+	const struct endpoint *epb = *(struct endpoint * const *)b;
+
+	if (epa->expected != epb->expected) {
+		if (epa->expected == -1)
+			return -1;
+		if (epb->expected == -1)
+			return 1;
+		return epa->expected > epb->expected ? -1 : 1;
+	}
+
+	return epa->order - epb->order;
+}
+
+/*
+ * Resolve the transfer profile of the next sync of an endpoint. If compression
+ * or wholefile is set to auto, pick it from the "n" syncs in "hist", oldest
+ * first.
+ *
+ * The connection is judged on the most recent sync that received at least
+ * AUTOMINXFER bytes, the rate of a sync that hardly transferred anything says
+ * nothing about the connection. If that sync received more than AUTORATE bytes
+ * per second, the connection is not the bottleneck, so don't spend any time on
+ * compression or on the delta algorithm. If the recent syncs all transferred
+ * too little to judge, compression is not worth it either. Otherwise compress,
+ * unless the most recent sync that was compressed showed that the data hardly
+ * compresses.
+ */
+static void
+autoprofile(struct endpoint *ep, const struct histent *hist, int n)
+{
+	const struct histent *rated, *he;
+	int fast, i;
+
+	ep->xfercompress = ep->compress;
+	ep->xferwhole = ep->wholefile;
+
+	rated = NULL;
+	for (i = n - 1; i >= 0 && rated == NULL; i--)
+		if (hist[i].stats.received >= AUTOMINXFER)
+			rated = &hist[i];
+
+	fast = 0;
+	if (rated != NULL)
+		fast = rated->stats.received / (rated->stats.elapsed > 0 ?
+			rated->stats.elapsed : 1) >= AUTORATE;
+
+	if (ep->xferwhole == WHOLEFILEAUTO)
+		ep->xferwhole = fast ? WHOLEFILEYES : WHOLEFILENO;
+
+	if (ep->xfercompress != COMPRESSAUTO)
+		return;
+
+	if (fast || (n > 0 && rated == NULL)) {
+		ep->xfercompress = COMPRESSNONE;
+		return;
+	}
+
+	ep->xfercompress = COMPRESSZLIB;
+
+	for (i = n - 1; i >= 0; i--) {
+		he = &hist[i];
+		if (!he->stats.compressed || he->stats.received == 0)
+			continue;
+
+		if (he->stats.literal < he->stats.received + he->stats.received
+		    / 10)
+			ep->xfercompress = COMPRESSNONE;
+		break;
+	}
+}
+
+/*
+ * Set the expected sync duration of an endpoint to the mean of the durations
+ * in the history file that is maintained by the rotator. Leave it unknown if
+ * there is no history. Resolve the transfer profile from the same history.
+ */
+static void
+loadhistory(struct endpoint *ep)
+{
+	struct histent hist[HISTSIZE];
+	time_t sum;
+	int fd, i, n;
+
+	n = 0;
+	if ((fd = openat(ep->pathfd, HISTFILE, O_RDONLY | O_CLOEXEC)) == -1) {
+		if (errno != ENOENT)
+			err(1, "%s: open %s", __func__, HISTFILE);
+	} else {
+		if ((n = readhistory(fd, hist)) == -1)
+			warn("%s: %s: readhistory", __func__, getepid(ep));
+
+		if (close(fd) == -1)
+			err(1, "%s: close", __func__);
+	}
+
+	autoprofile(ep, hist, n < 0 ? 0 : n);
+
+	if (n < 1)
+		return;
+
+	sum = 0;
+	for (i = 0; i < n; i++)
+		sum += hist[i].duration;
+
+	ep->expected = sum / n;
+}
+
+/*
+ * Process all endpoints in order, keeping up to maxjobs endpoints busy at the
+ * same time. Multiplex the communication channels of all endpoints and the
+ * exit of children so that events are handled in whatever order they arrive.
+ * Return when all processes are reaped.
+ *
+ * If devjobs is set, an endpoint is skipped as long as devjobs other endpoints
+ * on the same device are busy, so that jobs spread over different disks. The
+ * same goes for hostjobs and endpoints that backup the same remote host.
+ *
+ * Endpoints with prestage prepare their sync dir while they are queued. Up to
+ * maxjobs endpoints prestage at the same time, and a prestaging endpoint is
+ * busy on its device.
+ *
+ * No endpoints are started after the backup window closes. The syncer or
+ * postexec of an endpoint that exceeds its maximum run time is terminated and
+ * the new snapshot is cleaned up.
+ *
+ * If forkwindow is set, the processes of an endpoint are only forked when
+ * there are less than forkwindow endpoints with live processes. This keeps the
+ * number of processes and descriptors flat, but the master can only chroot
+ * and pledge once the processes of the last endpoint are forked.
+ */
+static void
+runjobs(struct endpoint **epv)
+{
+	struct sigaction sa;
+	struct endpoint **epp, **pep;
+	struct pollfd *pfd;
+	size_t n, npfd;
+	time_t now;
+	int active, staging, live, nready, sandboxed, timeout, needproc;
+	char buf[64];
+
+	/*
+	 * A fork window smaller than the number of jobs, i.e. because of -j,
+	 * would leave job slots unused.
+	 */
+	if (forkwindow > 0 && forkwindow < maxjobs) {
+		warnx("raising forkwindow from %d to %d jobs", forkwindow,
+			maxjobs);
+		forkwindow = maxjobs;
+	}
+
+	/*
+	 * Start the shared ssh connections before anything else so that they
+	 * do not inherit the self-pipe or the channels of other processes.
+	 */
+	startmux(epv);
+
+	/* Setup a self-pipe to get notified of exited children. */
+
+	if (pipe2(chldfd, O_CLOEXEC | O_NONBLOCK) == -1)
+		err(1, "%s: pipe2", __func__);
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = sigchld;
+	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+		err(1, "%s: sigaction", __func__);
+
+	/* Detect processes that are gone by a failing write. */
+	sa.sa_handler = SIG_IGN;
+	if (sigaction(SIGPIPE, &sa, NULL) == -1)
+		err(1, "%s: sigaction", __func__);
+
+	sandboxed = 0;
+
+	/* Only keep the ability to signal processes if it is needed. */
+	needproc = 0;
+
+	for (n = 0; epv[n] != NULL; n++)
+		if (epv[n]->maxruntime > 0)
+			needproc = 1;
+
+	/* Room for three channels per endpoint and the self-pipe. */
+	if ((pfd = reallocarray(NULL, 3 * n + 1, sizeof(*pfd))) == NULL)
+		err(1, "%s: reallocarray", __func__);
+	if ((pep = reallocarray(NULL, 3 * n + 1, sizeof(*pep))) == NULL)
+		err(1, "%s: reallocarray", __func__);
+
+	for (;;) {
+		reapchildren(epv);
+
+		if ((now = time(NULL)) == -1)
+			err(1, "%s: time", __func__);
+
+		/* Enforce the backup window and the maximum run times. */
+
+		if (windowclose > 0 && now >= windowclose)
+			skippending(epv, "backup window closed");
+
+		if (reloadreq)
+			skippending(epv, "skipped because of reload");
+
+		for (epp = epv; *epp; epp++)
+			if ((*epp)->deadline > 0 && now >= (*epp)->deadline)
+				overrun(*epp);
+
+		/*
+		 * Fork endpoints in order while there is room in the fork
+		 * window. Chroot and pledge as soon as all endpoints are forked.
+		 */
+
+		live = 0;
+		for (epp = epv; *epp; epp++)
+			if ((*epp)->state != EPNEW && (*epp)->state != EPDONE)
+				live++;
+
+		for (epp = epv; *epp; epp++) {
+			if ((*epp)->state != EPNEW)
+				continue;
+			if (forkwindow > 0 && live >= forkwindow)
+				break;
+
+			forkjob(epv, *epp);
+			live++;
+		}
+
+		if (*epp == NULL && !sandboxed) {
+			if (chroot(EMPTYDIR) == -1 || chdir("/") == -1)
+				err(1, "%s: chroot %s", __func__, EMPTYDIR);
+			if (pledge(needproc ? "stdio proc" : "stdio", NULL)
+			    == -1)
+				err(1, "%s: pledge", __func__);
+			sandboxed = 1;
+		}
+
+		/*
+		 * Let endpoints prestage in order while there are free slots,
+		 * prestaging counts against devjobs like a running job.
+		 */
+
+		staging = 0;
+		for (epp = epv; *epp; epp++)
+			if ((*epp)->state == EPPRESTAGING)
+				staging++;
+
+		for (epp = epv; *epp && staging < maxjobs; epp++) {
+			if ((*epp)->state != EPSTAGEWAIT)
+				continue;
+			if (devjobs > 0 &&
+			    devactive(epv, (*epp)->dev) >= devjobs)
+				continue;
+
+			prestagejob(*epp);
+			staging++;
+		}
+
+		/* Start endpoints in order while there are free job slots. */
+
+		active = 0;
+		for (epp = epv; *epp; epp++)
+			if ((*epp)->state != EPNEW &&
+			    (*epp)->state != EPSTAGEWAIT &&
+			    (*epp)->state != EPPRESTAGING &&
+			    (*epp)->state != EPQUEUED &&
+			    (*epp)->state != EPDONE)
+				active++;
+
+		for (epp = epv; *epp && active < maxjobs; epp++) {
+			if ((*epp)->state != EPQUEUED)
+				continue;
+			if (devjobs > 0 && devactive(epv, (*epp)->dev) >= devjobs)
+				continue;
+			if (hostjobs > 0 &&
+			    hostactive(epv, (*epp)->hostname) >= hostjobs)
+				continue;
+
+			startjob(*epp);
+			active++;
+		}
+
+		for (epp = epv; *epp; epp++)
+			if ((*epp)->state != EPDONE)
+				break;
+
+		if (*epp == NULL)
+			break;
+
+		/*
+		 * Wait for the next event, the closing of the backup window if
+		 * there are endpoints waiting to start, or the first deadline.
+		 */
+
+		timeout = INFTIM;
+
+		for (epp = epv; *epp; epp++) {
+			if (windowclose > 0 && ((*epp)->state == EPNEW ||
+			    (*epp)->state == EPSTAGEWAIT ||
+			    (*epp)->state == EPQUEUED))
+				timeout = timeoutat(timeout, now, windowclose);
+			if ((*epp)->deadline > 0)
+				timeout = timeoutat(timeout, now,
+					(*epp)->deadline);
+		}
+
+		npfd = 0;
+		addpollfd(pfd, pep, &npfd, NULL, chldfd[0]);
+		for (epp = epv; *epp; epp++) {
+			addpollfd(pfd, pep, &npfd, *epp, (*epp)->rotfd);
+			addpollfd(pfd, pep, &npfd, *epp, (*epp)->synfd);
+			addpollfd(pfd, pep, &npfd, *epp, (*epp)->poxfd);
+		}
+
+		if ((nready = poll(pfd, npfd, timeout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "%s: poll", __func__);
+		}
+
+		for (n = 0; n < npfd && nready > 0; n++) {
+			if (pfd[n].revents == 0)
+				continue;
+
+			nready--;
+
+			if (pep[n] == NULL) {
+				/* Drain the self-pipe, reap on the next run. */
+				while (read(chldfd[0], buf, sizeof(buf)) > 0)
+					;
+				continue;
+			}
+
+			/* The channel might be closed by a previous event. */
+
+			if (pfd[n].fd == pep[n]->rotfd)
+				rotatorcmd(pep[n]);
+			else if (pfd[n].fd == pep[n]->synfd)
+				childcmd(pep[n], &pep[n]->synfd, "syncer");
+			else if (pfd[n].fd == pep[n]->poxfd)
+				childcmd(pep[n], &pep[n]->poxfd, "postexec");
+		}
+	}
+
+	free(pfd);
+	free(pep);
+
+	stopmux(epv);
+
+	if (close(chldfd[0]) == -1 || close(chldfd[1]) == -1)
+		err(1, "%s: close", __func__);
+	chldfd[0] = chldfd[1] = -1;
 }
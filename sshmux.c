@@ -0,0 +1,84 @@
+#include <signal.h>
+
+#include "sshmux.h"
+
+/*
+ * Run an ssh control master for the remote user and host of "ep" on the
+ * control socket "ctlpath" until the master closes "fd". The syncers of all
+ * locations with the same local user, remote user and host connect through
+ * this socket so that only one ssh connection per host is set up.
+ *
+ * ssh runs as the local user. The directory of the control socket must be
+ * created by the caller and owned by the local user. It is removed on exit.
+ *
+ * Does not return.
+ */
+void
+sshmux(const struct endpoint *ep, const char *ctlpath, int fd)
+{
+	pid_t pid;
+	char c, *dir, *dst;
+	int status;
+
+	/* expect stdout, stderr and the communication channel only */
+	if (isopenfd(STDOUT_FILENO) != 1)
+		errx(1, "expected stdout to be open");
+	if (isopenfd(STDERR_FILENO) != 1)
+		errx(1, "expected stderr to be open");
+	if (isopenfd(fd) != 1)
+		errx(1, "expected communication channel to be open");
+
+	if (asprintf(&dst, "%s@%s", ep->ruser, ep->hostname) <= 0)
+		err(1, "%s: asprintf", __func__);
+
+	if ((pid = fork()) == -1)
+		err(1, "%s: fork", __func__);
+
+	if (pid == 0) {
+		if (privdrop(ep->uid, ep->gid) == -1)
+			errx(1, "sshmux[%d]: %s could not drop privileges",
+				getpid(), getepid(ep));
+
+		if (verbose > 1)
+			fprintf(stdout, "sshmux[%d]: %s %s\n", getpid(), dst,
+				ctlpath);
+
+		/*
+		 * Never prompt, a master that can not login on its own is of
+		 * no use to the syncers.
+		 */
+		execlp(SSHBIN, SSHBIN, "-MNn", "-o", "BatchMode=yes", "-o",
+			"ControlPersist=no", "-S", ctlpath, dst, (char *)NULL);
+		err(1, "sshmux[%d]: exec %s", getpid(), SSHBIN);
+	}
+
+	free(dst);
+	dst = NULL;
+
+	/* Only wait for ssh and clean up. */
+	if (pledge("stdio cpath proc", NULL) == -1)
+		err(1, "%s: pledge", __func__);
+
+	/* Block until the master is done with all locations. */
+	while (read(fd, &c, 1) == -1 && errno == EINTR)
+		;
+
+	if (kill(pid, SIGTERM) == -1 && errno != ESRCH)
+		err(1, "%s: kill", __func__);
+
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			err(1, "%s: waitpid", __func__);
+
+	/* ssh removes the socket itself, unless it was killed too early */
+	if (unlink(ctlpath) == -1 && errno != ENOENT)
+		warn("%s: unlink %s", __func__, ctlpath);
+
+	if ((dir = strdup(ctlpath)) == NULL)
+		err(1, "%s: strdup", __func__);
+	if (rmdir(dirname(dir)) == -1)
+		warn("%s: rmdir %s", __func__, dir);
+	free(dir);
+
+	exit(0);
+}
@@ -0,0 +1,14 @@
+#ifndef SSHMUX_H
+#define SSHMUX_H
+
+#include "util.h"
+
+#define SSHBIN "ssh"
+#define MUXDIR "/tmp/snaps.XXXXXXXXXX"	/* Template of a control socket dir. */
+#define MUXSOCK "ctl"	/* Name of the control socket in its dir. */
+
+extern int verbose;
+
+void sshmux(const struct endpoint *, const char *, int);
+
+#endif
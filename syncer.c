@@ -1,12 +1,64 @@
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+
 #include "syncer.h"
 
+#define STATSFIRST "Number of files: "	/* first line of rsync --stats */
+#define STATSLAST "total size is "	/* last line of rsync --stats */
+
+/* an rsync of the location, or of one of its shards */
+struct rsyncproc {
+	pid_t pid;	/* process id, 0 if not running */
+	int fd;	/* read end of its stdout, -1 at end of file */
+	const char *shard;	/* NULL for the rest of the location */
+	int instats;	/* whether the output is in the statistics */
+	int hasstats;	/* whether all statistics are seen */
+	size_t len;	/* length of the partial line in buf */
+	char buf[PATH_MAX + 64];
+};
+
+/* a value of interest in the output of rsync --stats */
+struct statfield {
+	const char *prefix;	/* start of the line */
+	const char *key;	/* text before the number, or NULL */
+	size_t offset;	/* offset of the off_t in struct xferstats */
+};
+
+static const struct statfield statfields[] = {
+	{ "Number of files: ", NULL, offsetof(struct xferstats, files) },
+	{ "Number of files: ", "reg: ", offsetof(struct xferstats, regfiles) },
+	{ "Number of created files: ", NULL,
+		offsetof(struct xferstats, created) },
+	{ "Number of deleted files: ", NULL,
+		offsetof(struct xferstats, deleted) },
+	{ "Number of regular files transferred: ", NULL,
+		offsetof(struct xferstats, transferred) },
+	{ "Total file size: ", NULL, offsetof(struct xferstats, size) },
+	{ "Total transferred file size: ", NULL,
+		offsetof(struct xferstats, xfersize) },
+	{ "Literal data: ", NULL, offsetof(struct xferstats, literal) },
+	{ "Matched data: ", NULL, offsetof(struct xferstats, matched) },
+	{ "Total bytes sent: ", NULL, offsetof(struct xferstats, sent) },
+	{ "Total bytes received: ", NULL,
+		offsetof(struct xferstats, received) },
+	{ NULL, NULL, 0 }
+};
+
+static struct rsyncproc *procv;
+static size_t nprocs;
+
 /*
- * Execs rsync and creates a new backup for the given snapshot interval.
+ * Execs rsync and creates a new backup for the given snapshot interval. If
+ * "shard" is set only this subdir of the location is synced, otherwise
+ * everything except the configured shards.
  *
  * Does not return on success or returns on error.
  */
-void
-execrsync(const struct endpoint *ep, const char *destdir, const char *linkdest)
+static void
+execrsync(const struct endpoint *ep, const char *destdir, char **linkdests,
+    const char *shard)
 {
 	int i;
 	const char *rsyncbin;
@@ -24,8 +76,9 @@ execrsync(const struct endpoint *ep, const char *destdir, const char *linkdest)
 		rsyncbin = ep->rsyncbin;
 
 	rsyncargv = addstr(rsyncargv, basename((char *)rsyncbin));
-	rsyncargv = addstr(rsyncargv, "-azz");
+	rsyncargv = addstr(rsyncargv, "-a");
 	rsyncargv = addstr(rsyncargv, "--delete");
+	rsyncargv = addstr(rsyncargv, "--stats");
 	/* prevent pledges for getpw, unix and dpath */
 	rsyncargv = addstr(rsyncargv, "--numeric-ids");
 	rsyncargv = addstr(rsyncargv, "--no-specials");
@@ -40,18 +93,88 @@ execrsync(const struct endpoint *ep, const char *destdir, const char *linkdest)
 	free(tmp);
 	tmp = NULL;
 
-	/* setup link-dest arg if there is a snapshot on disk */
-	if (linkdest != NULL) {
-		if (asprintf(&tmp, "--link-dest=%s", linkdest) <= 0)
+	/*
+	 * Keep partially transferred files out of the way of the new snapshot
+	 * so that an interrupted sync can be resumed.
+	 */
+	if (ep->resume)
+		rsyncargv = addstr(rsyncargv, "--partial-dir=" PARTIALDIR);
+
+	/* setup link-dest args if there are snapshots on disk */
+	for (i = 0; linkdests != NULL && linkdests[i] != NULL; i++) {
+		if (asprintf(&tmp, "--link-dest=%s", linkdests[i]) <= 0)
+			err(1, "%s: asprintf", __func__);
+		rsyncargv = addstr(rsyncargv, tmp);
+		free(tmp);
+		tmp = NULL;
+	}
+
+	/* Transfer profile, any auto setting is resolved by the master. */
+	switch (ep->xfercompress) {
+	case COMPRESSZLIB:
+		rsyncargv = addstr(rsyncargv, "-zz");
+		break;
+	default:
+		break;
+	}
+
+	if (ep->xfercompress != COMPRESSNONE && ep->compresslevel > 0) {
+		if (asprintf(&tmp, "--compress-level=%d", ep->compresslevel)
+		    <= 0)
+			err(1, "%s: asprintf", __func__);
+		rsyncargv = addstr(rsyncargv, tmp);
+		free(tmp);
+		tmp = NULL;
+	}
+
+	if (ep->xferwhole == WHOLEFILEYES)
+		rsyncargv = addstr(rsyncargv, "--whole-file");
+
+	if (ep->blocksize > 0) {
+		if (asprintf(&tmp, "--block-size=%d", ep->blocksize) <= 0)
+			err(1, "%s: asprintf", __func__);
+		rsyncargv = addstr(rsyncargv, tmp);
+		free(tmp);
+		tmp = NULL;
+	}
+
+	/*
+	 * Login through the shared connection of the host if there is one. ssh
+	 * falls back to a connection of its own if the master is not up (yet).
+	 */
+	if (ep->sshctl != NULL) {
+		if (asprintf(&tmp, "-e%s -S %s -o ControlMaster=no", SSHBIN,
+		    ep->sshctl) <= 0)
+			err(1, "%s: asprintf", __func__);
+		rsyncargv = addstr(rsyncargv, tmp);
+		free(tmp);
+		tmp = NULL;
+	}
+
+	/*
+	 * Keep the subdir name below the destination dir so that every shard
+	 * shares the same destination and link-dest dirs.
+	 */
+	if (shard != NULL)
+		rsyncargv = addstr(rsyncargv, "--relative");
+
+	/*
+	 * Leave the shards to their own rsync, this also protects them from
+	 * --delete.
+	 */
+	for (i = 0; shard == NULL && ep->shards && ep->shards[i]; i++) {
+		if (asprintf(&tmp, "--exclude=/%s", ep->shards[i]) <= 0)
 			err(1, "%s: asprintf", __func__);
 		rsyncargv = addstr(rsyncargv, tmp);
 		free(tmp);
 		tmp = NULL;
 	}
 
-	if (verbose < 0) /* quiet */
-		rsyncargv = addstr(rsyncargv, "-q");
-	else if (verbose > 1)
+	/*
+	 * Never pass -q, it would suppress the statistics as well. When quiet,
+	 * readrsync drops the output instead.
+	 */
+	if (verbose > 1)
 		for (i = 1; i < verbose; i++)
 			rsyncargv = addstr(rsyncargv, "-v");
 
@@ -73,7 +196,13 @@ execrsync(const struct endpoint *ep, const char *destdir, const char *linkdest)
 		if (ep->rpath[i - 1] != '/')
 			fmt = "%s@%s:%s/";
 
-	if (asprintf(&tmp, fmt, ep->ruser, ep->hostname, ep->rpath) <= 0)
+	/* only the path after the dot is recreated with --relative */
+	if (shard != NULL)
+		i = asprintf(&tmp, "%s@%s:%s/./%s", ep->ruser, ep->hostname,
+			ep->rpath, shard);
+	else
+		i = asprintf(&tmp, fmt, ep->ruser, ep->hostname, ep->rpath);
+	if (i <= 0)
 		err(1, "%s: asprintf", __func__);
 	rsyncargv = addstr(rsyncargv, tmp);
 	free(tmp);
@@ -90,13 +219,302 @@ execrsync(const struct endpoint *ep, const char *destdir, const char *linkdest)
 			rsyncbin == NULL ? "empty" : rsyncbin);
 }
 
+/*
+ * Forward a termination request, i.e. because of maxruntime, to every rsync.
+ */
+static void
+stoprsyncs(int sig)
+{
+	size_t n;
+	int saved;
+
+	saved = errno;
+	for (n = 0; n < nprocs; n++)
+		if (procv[n].pid > 0)
+			(void)kill(procv[n].pid, sig);
+	errno = saved;
+}
+
+/*
+ * Determine whether an rsync exit status is considered a success.
+ */
+static int
+acceptexit(const struct endpoint *ep, int i)
+{
+	int **rsyncexit;
+
+	if (i == 0)
+		return 1;
+
+	for (rsyncexit = ep->rsyncexit; rsyncexit && *rsyncexit; rsyncexit++)
+		if (i == **rsyncexit)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Parse one line of the output of rsync --stats and add any value of interest
+ * to "stats", so that the values of all shards add up. Numbers with units,
+ * i.e. because of --human-readable, are ignored.
+ *
+ * Return 1 if the line is part of the statistics, 0 otherwise.
+ */
+static int
+parsestats(struct rsyncproc *rp, const char *line, struct xferstats *stats)
+{
+	const struct statfield *sf;
+	const char *errstr, *cp;
+	char num[32];
+	size_t i;
+	off_t v;
+
+	if (strncmp(line, STATSFIRST, strlen(STATSFIRST)) == 0)
+		rp->instats = 1;
+
+	if (!rp->instats)
+		return 0;
+
+	if (strncmp(line, STATSLAST, strlen(STATSLAST)) == 0) {
+		rp->instats = 0;
+		rp->hasstats = 1;
+	}
+
+	for (sf = statfields; sf->prefix != NULL; sf++) {
+		if (strncmp(line, sf->prefix, strlen(sf->prefix)) != 0)
+			continue;
+
+		cp = line + strlen(sf->prefix);
+		if (sf->key != NULL) {
+			if ((cp = strstr(cp, sf->key)) == NULL)
+				continue;
+			cp += strlen(sf->key);
+		}
+
+		for (i = 0; *cp != '\0' && strchr(" )", *cp) == NULL &&
+		    i < sizeof(num) - 1; cp++)
+			if (*cp != ',')
+				num[i++] = *cp;
+		num[i] = '\0';
+
+		v = strtonum(num, 0, LLONG_MAX, &errstr);
+		if (errstr == NULL)
+			*(off_t *)((char *)stats + sf->offset) += v;
+	}
+
+	return 1;
+}
+
+/*
+ * Read the available output of an rsync, forward it to stdout and parse every
+ * complete line. The statistics are only forwarded if verbose or if the user
+ * asked for them, any other output is dropped if quiet.
+ *
+ * Return 0 if there is more to read, or -1 on end of file.
+ */
+static int
+readrsync(struct rsyncproc *rp, struct xferstats *stats, int showstats)
+{
+	ssize_t r;
+	char *nl, *line;
+	size_t len;
+
+	r = read(rp->fd, rp->buf + rp->len, sizeof(rp->buf) - 1 - rp->len);
+	if (r == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		err(1, "%s: read", __func__);
+	}
+
+	rp->len += r;
+	rp->buf[rp->len] = '\0';
+
+	line = rp->buf;
+	while ((nl = strchr(line, '\n')) != NULL) {
+		*nl = '\0';
+		if (parsestats(rp, line, stats) ? showstats : verbose >= 0)
+			fprintf(stdout, "%s\n", line);
+		line = nl + 1;
+	}
+
+	/* Forward a partial line as is if it is too long or the end is near. */
+	len = rp->len - (line - rp->buf);
+	if (len == sizeof(rp->buf) - 1 || (r == 0 && len > 0)) {
+		if (rp->instats ? showstats : verbose >= 0)
+			fprintf(stdout, "%s", line);
+		len = 0;
+	}
+
+	memmove(rp->buf, line, len);
+	rp->len = len;
+
+	if (fflush(stdout) == EOF)
+		err(1, "%s: fflush", __func__);
+
+	return r == 0 ? -1 : 0;
+}
+
+/*
+ * Run an rsync for every configured shard and one for the rest of the
+ * location at the same time, all into "destdir". Without shards only one rsync
+ * is run for the whole location. Their output is passed through and parsed for
+ * the transfer statistics, which are sent to the master when all rsyncs are
+ * done.
+ *
+ * Exit with the first exit status that is not accepted by rsyncexit, if any.
+ * Otherwise exit with the first non-zero exit status, or 0 if all succeeded.
+ */
+static void
+runrsyncs(const struct endpoint *ep, const char *destdir, char **linkdests)
+{
+	struct xferstats stats;
+	struct sigaction sa;
+	struct pollfd *pfd;
+	sigset_t set, oset;
+	size_t n, nopen;
+	pid_t pid;
+	time_t start;
+	int i, status, merged, showstats, pipefd[2];
+
+	nprocs = 1;
+	while (ep->shards && ep->shards[nprocs - 1])
+		nprocs++;
+
+	if ((procv = calloc(nprocs, sizeof(*procv))) == NULL)
+		err(1, "%s: calloc", __func__);
+	if ((pfd = reallocarray(NULL, nprocs, sizeof(*pfd))) == NULL)
+		err(1, "%s: reallocarray", __func__);
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = stoprsyncs;
+	if (sigaction(SIGTERM, &sa, NULL) == -1)
+		err(1, "%s: sigaction", __func__);
+
+	/* Defer termination until every rsync can be stopped. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &set, &oset) == -1)
+		err(1, "%s: sigprocmask", __func__);
+
+	if ((start = time(NULL)) == -1)
+		err(1, "%s: time", __func__);
+
+	for (n = 0; n < nprocs; n++) {
+		procv[n].shard = n < nprocs - 1 ? ep->shards[n] : NULL;
+
+		if (pipe2(pipefd, O_CLOEXEC) == -1)
+			err(1, "%s: pipe2", __func__);
+
+		if ((pid = fork()) == -1)
+			err(1, "%s: fork", __func__);
+
+		if (pid == 0) {
+			sa.sa_handler = SIG_DFL;
+			if (sigaction(SIGTERM, &sa, NULL) == -1)
+				err(1, "%s: sigaction", __func__);
+			if (sigprocmask(SIG_SETMASK, &oset, NULL) == -1)
+				err(1, "%s: sigprocmask", __func__);
+
+			if (dup2(pipefd[1], STDOUT_FILENO) == -1)
+				err(1, "%s: dup2", __func__);
+
+			execrsync(ep, destdir, linkdests, procv[n].shard);
+			errx(1, "%s: execrsync returned %s", __func__,
+				getepid(ep));
+		}
+
+		if (close(pipefd[1]) == -1)
+			err(1, "%s: close", __func__);
+
+		procv[n].pid = pid;
+		procv[n].fd = pipefd[0];
+	}
+
+	if (sigprocmask(SIG_SETMASK, &oset, NULL) == -1)
+		err(1, "%s: sigprocmask", __func__);
+
+	/* Only pass on output and statistics from now on. */
+	if (pledge("stdio proc", NULL) == -1)
+		err(1, "%s: pledge", __func__);
+
+	showstats = verbose > 0;
+	for (i = 0; ep->rsyncargv && ep->rsyncargv[i]; i++)
+		if (strcmp(ep->rsyncargv[i], "--stats") == 0)
+			showstats = 1;
+
+	memset(&stats, 0, sizeof(stats));
+
+	for (nopen = nprocs; nopen > 0;) {
+		for (n = 0; n < nprocs; n++) {
+			pfd[n].fd = procv[n].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+		}
+
+		if (poll(pfd, nprocs, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "%s: poll", __func__);
+		}
+
+		for (n = 0; n < nprocs; n++) {
+			if (pfd[n].revents == 0)
+				continue;
+
+			if (readrsync(&procv[n], &stats, showstats) == -1) {
+				if (close(procv[n].fd) == -1)
+					err(1, "%s: close", __func__);
+				procv[n].fd = -1;
+				nopen--;
+			}
+		}
+	}
+
+	free(pfd);
+
+	merged = 0;
+	for (n = 0; n < nprocs; n++) {
+		while (waitpid(procv[n].pid, &status, 0) == -1)
+			if (errno != EINTR)
+				err(1, "%s: waitpid", __func__);
+
+		i = exitcode(procv[n].pid, status);
+		procv[n].pid = 0;
+
+		if (i != 0 && (merged == 0 || (acceptexit(ep, merged) &&
+		    !acceptexit(ep, i))))
+			merged = i;
+
+		if (i != 0 && procv[n].shard != NULL && verbose > 0)
+			fprintf(stdout, "syncer[%d]: %s shard %s exit %d\n",
+				getpid(), getepid(ep), procv[n].shard, i);
+	}
+
+	stats.elapsed = time(NULL) - start;
+	stats.compressed = ep->xfercompress != COMPRESSNONE;
+
+	stats.complete = 1;
+	for (n = 0; n < nprocs; n++)
+		if (!procv[n].hasstats)
+			stats.complete = 0;
+
+	if (writecmd(ep->synfd, CMDSTATS) == -1 ||
+	    writestats(ep->synfd, &stats) == -1)
+		warn("syncer[%d]: %s could not send statistics", getpid(),
+			getepid(ep));
+
+	exit(merged);
+}
+
 /* Exec rsync for the only endpoint in memory. */
 void
 syncer(struct endpoint *ep)
 {
-	struct snapshot s;
-	int cmd;
-	char *cp, *cp2, *linkdest;
+	struct snapshot sv[MAXLINKDESTS];
+	int cmd, i, n;
+	const char *destdir;
+	char *cp, *cp2, **linkdests;
 
 	if (pledge("stdio id rpath proc exec", NULL) == -1)
 		err(1, "%s: pledge", __func__);
@@ -148,20 +566,22 @@ syncer(struct endpoint *ep)
 	cp2 = NULL;
 
 	/*
-	 * Determine the youngest snapshot interval on disk and setup linkdest
-	 * if one is found, relative to the destination dir.
+	 * Determine the newest snapshots of each interval on disk and setup
+	 * linkdests relative to the destination dir.
 	 */
-	linkdest = NULL;
-	cp = NULL;
+	linkdests = NULL;
 
-	if (newestsnapshot(ep, &s))
-		cp = snapshotname(&s);
+	n = linkdestsnapshots(ep, sv, ep->linkdests);
 
-	if (cp != NULL) {
-		if (asprintf(&linkdest, "../%s", cp) <= 0)
+	for (i = 0; i < n; i++) {
+		cp = snapshotname(&sv[i]);
+		if (asprintf(&cp2, "../%s", cp) <= 0)
 			err(1, "%s: asprintf", __func__);
+		linkdests = addstr(linkdests, cp2);
 		free(cp);
 		cp = NULL;
+		free(cp2);
+		cp2 = NULL;
 	}
 
 	if (verbose > 2)
@@ -173,7 +593,9 @@ syncer(struct endpoint *ep)
 	 * Use a relative path for destination dir so search permissions higher
 	 * up the hierarchy are not needed.
 	 */
-	execrsync(ep, ".", linkdest); /* exec, so no need to free cp */
+	destdir = ".";
+
+	runrsyncs(ep, destdir, linkdests);
 
-	errx(1, "%s: execrsync returned %s", __func__, getepid(ep));
+	errx(1, "%s: runrsyncs returned %s", __func__, getepid(ep));
 }
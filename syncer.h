@@ -3,9 +3,11 @@
 
 #include <fcntl.h>
 
+#include "sshmux.h"
 #include "util.h"
 
 #define RSYNCBIN "/usr/local/sbin/prsync"
+#define PARTIALDIR ".rsync-partial"
 
 extern int verbose;
 
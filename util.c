@@ -8,7 +8,9 @@ const int CMDCLOSED	= 0x0000,
 	CMDREADY	= 0x0004,
 	CMDROTCLEANUP	= 0x0008,
 	CMDROTINCLUDE	= 0x000c,
-	CMDCUST		= 0x0010;	/* Followed by a custom integer. */
+	CMDCUST		= 0x0010,	/* Followed by a custom integer. */
+	CMDSTATS	= 0x0020,	/* Followed by a struct xferstats. */
+	CMDPRESTAGE	= 0x0040;
 
 static struct snapinterval *snapshotinterval(const struct snapshot *);
 
@@ -151,6 +153,33 @@ snaps_alloc_endpoint(char *ruser, char *hostname, char *rpath, char *root,
 	ep->poxfd = -1;
 	ep->poxpid = -1;
 
+	ep->state = EPNEW;
+	ep->expected = -1;
+	ep->maxruntime = 0;
+	ep->deadline = 0;
+	ep->overrun = 0;
+	ep->failed = 0;
+	ep->lastrun = 0;
+	ep->rmthreads = 1;
+	ep->rmrate = 0;
+	ep->rmload = 0;
+	ep->asyncpurge = 0;
+	ep->layout = LAYOUTRENAME;
+	ep->resume = 0;
+	ep->prestage = 0;
+	ep->prestagethreads = 1;
+	ep->linkdests = 1;
+	ep->sshmux = 0;
+	ep->sshctl = NULL;
+	ep->shards = NULL;
+	ep->compress = COMPRESSZLIB;
+	ep->compresslevel = 0;
+	ep->wholefile = WHOLEFILENO;
+	ep->blocksize = 0;
+	ep->xfercompress = COMPRESSZLIB;
+	ep->xferwhole = WHOLEFILENO;
+	memset(&ep->stats, 0, sizeof(ep->stats));
+
 	return ep;
 }
 
@@ -181,6 +210,7 @@ snaps_free_endpoint(struct endpoint **ep)
 
 	clrstrv(&(*ep)->rsyncargv); /* rsyncargv is set to null */
 	clrintv(&(*ep)->rsyncexit); /* rsyncexit is set to null */
+	clrstrv(&(*ep)->shards); /* shards is set to null */
 
 	free((*ep)->postexec);
 	(*ep)->postexec = NULL;
@@ -1134,6 +1164,18 @@ again:
 		return -1;
 	}
 
+	return exitcode(pid, status);
+}
+
+/*
+ * Convert a status as returned by waitpid(2) into an exit code.
+ *
+ * Return the exit status if exited or return 128 if the process exited because
+ * of a signal.
+ */
+int
+exitcode(pid_t pid, int status)
+{
 	if (!WIFEXITED(status)) {
 		if (WIFSIGNALED(status)) {
 			warnx("%d terminated by signal \"%s\"",
@@ -1331,16 +1373,24 @@ int
 opensnapshot(const struct snapshot *s)
 {
 	char *dir;
-	int fd;
+	int fd, flags;
 
 	if (s == NULL || s->ep == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	/*
+	 * Only follow symlinks in a fixed layout, where interval.number is a
+	 * symlink to the snapshot. It is made by the rotator in a directory
+	 * only writable by the superuser.
+	 */
+	flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	if (s->ep->layout != LAYOUTFIXED)
+		flags |= O_NOFOLLOW;
+
 	dir = snapdirstr(s->name, s->number);
-	fd = openat(s->ep->pathfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
-		O_NOFOLLOW);
+	fd = openat(s->ep->pathfd, dir, flags);
 	free(dir);
 	dir = NULL;
 
@@ -1400,6 +1450,44 @@ newestsnapshot(struct endpoint *ep, struct snapshot *s)
 	return NULL;
 }
 
+/*
+ * Find up to "max" snapshots on disk to use as link-dest, newest first: the
+ * first snapshot of each interval, then the second of each interval and so on.
+ *
+ * Return the number of snapshots stored in "sv".
+ */
+int
+linkdestsnapshots(struct endpoint *ep, struct snapshot *sv, int max)
+{
+	struct snapinterval **siv;
+	struct snapshot s;
+	time_t age;
+	int i, more, n;
+
+	n = 0;
+	for (i = 1; n < max; i++) {
+		more = 0;
+
+		for (siv = ep->snapshots; siv && *siv && n < max; siv++) {
+			if (i > (*siv)->count)
+				continue;
+
+			more = 1;
+
+			if (setsnapshot(ep, (*siv)->name, i, &s) == -1)
+				err(1, "%s: setsnapshot", __func__);
+
+			if (snapshotttl(&s, 0, &age) || age)
+				sv[n++] = s;
+		}
+
+		if (!more)
+			break;
+	}
+
+	return n;
+}
+
 /*
  * Set a snapshot.
  *
@@ -1464,24 +1552,36 @@ snapshotinterval(const struct snapshot *s)
  */
 time_t
 snapshotttl(struct snapshot *s, time_t now, time_t *age)
+{
+	time_t born;
+
+	born = snapshottime(s);
+	if (born == -1 && errno != ENOENT) /* errno is set */
+		return -1;
+
+	return bornttl(s, born, now, age);
+}
+
+/*
+ * Same as snapshotttl but with a known creation time "born" of the snapshot, -1
+ * if the snapshot does not exist. Does not access the disk.
+ */
+time_t
+bornttl(struct snapshot *s, time_t born, time_t now, time_t *age)
 {
 	struct snapinterval *si;
-	time_t born, a;
+	time_t a;
 	int i;
 
 	if ((si = snapshotinterval(s)) == NULL)
 		err(1, "%s: snapshotinterval", __func__);
 
-	born = snapshottime(s);
-	if (born == -1 && errno == ENOENT) {
+	if (born == -1) {
 		if (age)
 			*age = 0;
 		return 0;
 	}
 
-	if (born == -1) /* errno is set */
-		return -1;
-
 	a = now - born;
 
 	if (age)
@@ -1497,6 +1597,265 @@ snapshotttl(struct snapshot *s, time_t now, time_t *age)
 	return 0;
 }
 
+/*
+ * Determine whether a new snapshot is due for an endpoint by looking at the
+ * first snapshot of the first interval. Only reads from disk, via the pathfd of
+ * the endpoint.
+ *
+ * If ttl or age is not null, it is set to the ttl or age of the first snapshot,
+ * see snapshotttl.
+ *
+ * Return 1 if a new snapshot is due, 0 if not or -1 on error with errno set.
+ */
+int
+snapshotdue(struct endpoint *ep, time_t now, time_t *ttl, time_t *age)
+{
+	struct snapshot s;
+	time_t t, a;
+
+	if (ep->snapshots == NULL || *ep->snapshots == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (setsnapshot(ep, ep->snapshots[0]->name, 1, &s) == -1)
+		return -1;
+
+	if ((t = snapshotttl(&s, now, &a)) == -1)
+		return -1;
+
+	if (ttl)
+		*ttl = t;
+	if (age)
+		*age = a;
+
+	return (t - TIMEPAD) > 0 ? 0 : 1;
+}
+
+/*
+ * Parse a duration in seconds, optionally followed by one of the units "s", "m",
+ * "h" or "d" for seconds, minutes, hours or days.
+ *
+ * Return 0 on success and store the number of seconds in "res", or -1 on error
+ * with errno set.
+ */
+int
+parseduration(const char *str, time_t *res)
+{
+	const char *errstr;
+	char num[12];
+	size_t len;
+	time_t unit;
+
+	len = strlen(str);
+	if (len == 0 || len >= sizeof(num)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(num, str, len + 1);
+
+	unit = 1;
+	switch (num[len - 1]) {
+	case 'd':
+		unit *= 24;
+		/* FALLTHROUGH */
+	case 'h':
+		unit *= 60;
+		/* FALLTHROUGH */
+	case 'm':
+		unit *= 60;
+		/* FALLTHROUGH */
+	case 's':
+		num[len - 1] = '\0';
+		break;
+	}
+
+	*res = strtonum(num, 0, INT_MAX / unit, &errstr);
+	if (errstr != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*res *= unit;
+
+	return 0;
+}
+
+/*
+ * Parse a time of day in the format HH:MM.
+ *
+ * Return 0 on success and store the number of minutes since midnight in "res",
+ * or -1 on error with errno set.
+ */
+int
+parsetimeofday(const char *str, int *res)
+{
+	if (strlen(str) != 5 || !isdigit((unsigned char)str[0]) ||
+	    !isdigit((unsigned char)str[1]) || str[2] != ':' ||
+	    !isdigit((unsigned char)str[3]) || !isdigit((unsigned char)str[4])) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*res = ((str[0] - '0') * 10 + str[1] - '0') * 60 +
+		(str[3] - '0') * 10 + str[4] - '0';
+
+	if (*res >= 24 * 60 || str[3] > '5') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the most recent syncs from the history file "fd" into "hist", oldest
+ * first. "hist" must have room for HISTSIZE entries. The file contains one sync
+ * per line: the duration in seconds, optionally followed by the number of bytes
+ * received, the number of literal bytes, whether the data was compressed and
+ * the number of seconds all rsyncs took. The statistics of syncs without them
+ * are set to zero.
+ *
+ * Return the number of syncs read on success, or -1 on error with errno set.
+ */
+int
+readhistory(int fd, struct histent *hist)
+{
+	char buf[HISTSIZE * 96 + 1], *cp, *line, *field;
+	const char *errstr;
+	off_t v[5];
+	ssize_t r;
+	size_t len;
+	int i, n;
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return -1;
+
+	len = 0;
+	while ((r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += r;
+
+	if (r == -1)
+		return -1;
+
+	buf[len] = '\0';
+
+	n = 0;
+	cp = buf;
+	while ((line = strsep(&cp, "\n")) != NULL && n < HISTSIZE) {
+		if (*line == '\0')
+			continue;
+
+		memset(v, 0, sizeof(v));
+		for (i = 0; (field = strsep(&line, " ")) != NULL; i++) {
+			if (i == 5) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			v[i] = strtonum(field, 0, i == 0 ? INT_MAX : LLONG_MAX,
+				&errstr);
+			if (errstr != NULL) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+
+		hist[n].duration = v[0];
+		hist[n].stats.received = v[1];
+		hist[n].stats.literal = v[2];
+		hist[n].stats.compressed = v[3] != 0;
+		hist[n].stats.elapsed = v[4];
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Replace the contents of history file "fd" with the "n" syncs in "hist"
+ * followed by "new". The oldest sync is dropped if there would be more than
+ * HISTSIZE entries.
+ *
+ * Return 0 on success, or -1 on error with errno set.
+ */
+int
+writehistory(int fd, const struct histent *hist, int n,
+    const struct histent *new)
+{
+	int i;
+
+	if (n < 0 || n > HISTSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (n == HISTSIZE) {
+		hist++;
+		n--;
+	}
+
+	if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1)
+		return -1;
+
+	for (i = 0; i <= n; i++, hist++) {
+		if (i == n)
+			hist = new;
+
+		if (dprintf(fd, "%lld %lld %lld %d %lld\n", hist->duration,
+		    hist->stats.received, hist->stats.literal,
+		    hist->stats.compressed, hist->stats.elapsed) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the transfer statistics of a sync to a communication channel, it
+ * should be preceded by CMDSTATS.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+int
+writestats(int commfd, const struct xferstats *stats)
+{
+	int i;
+
+	if ((i = write(commfd, stats, sizeof(*stats))) == -1)
+		return -1; /* errno set by write(2) */
+
+	if (i != sizeof(*stats))
+		errx(1, "%s: %d bytes written instead of %lu", __func__, i,
+			sizeof(*stats));
+
+	return 0;
+}
+
+/*
+ * Read the transfer statistics of a sync that follow CMDSTATS.
+ *
+ * Return 0 on success, -1 on failure with errno set.
+ */
+int
+readstats(int commfd, struct xferstats *stats)
+{
+	int i;
+
+	if ((i = read(commfd, stats, sizeof(*stats))) == -1)
+		return -1; /* errno set by read(2) */
+
+	if (i != sizeof(*stats)) {
+		warnx("%s: %d bytes read instead of %lu", __func__, i,
+			sizeof(*stats));
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Prepare an execution environment: pledge, change user/group etc.
  *
@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -20,6 +21,15 @@
 
 #define SYNCDIR ".sync"
 #define LOCKFILE ".lock"
+#define SNAPPREFIX "snap"	/* Name of snapshot directories in a fixed layout. */
+#define HISTFILE ".history"
+#define HISTSIZE 5	/* Number of sync durations to remember. */
+#define MAXLINKDESTS 20	/* Maximum number of link-dest dirs rsync accepts. */
+#define MAXCOMPRESSLEVEL 9	/* Highest compression level of zlib. */
+#define MAXBLOCKSIZE 131072	/* Largest block size rsync accepts. */
+#define RETRYWAIT 600	/* Number of seconds a daemon waits before it retries a
+			 * failed run.
+			 */
 #define TIMEPAD 30	/* Number of seconds to ignore when determining if it's
 			 * time to make a new backup.
 			 */
@@ -29,7 +39,71 @@
 extern int verbose;
 
 extern const int CMDCLOSED, CMDSTART, CMDSTOP, CMDREADY, CMDROTCLEANUP,
-	CMDROTINCLUDE, CMDCUST;
+	CMDROTINCLUDE, CMDCUST, CMDSTATS, CMDPRESTAGE;
+
+/* state of an endpoint as seen by the master */
+enum epstate {
+	EPNEW,		/* no processes forked yet */
+	EPSTAGEWAIT,	/* waiting for a free slot to prestage */
+	EPPRESTAGING,	/* waiting for the rotator to prestage */
+	EPQUEUED,	/* waiting for a free job slot */
+	EPSTARTING,	/* waiting for the rotator to be ready */
+	EPSYNCING,	/* waiting for the syncer to exit */
+	EPPOSTEXEC,	/* waiting for postexec to exit */
+	EPFINISHING,	/* rotator signalled, waiting for all processes to exit */
+	EPDONE
+};
+
+/* order in which the master starts endpoints */
+enum schedule {
+	SCHEDCONFIG,	/* order of the config file */
+	SCHEDOVERDUE,	/* most overdue first */
+	SCHEDLONGEST	/* longest expected sync first */
+};
+
+/* how snapshot directories are named on disk */
+enum layout {
+	LAYOUTRENAME,	/* interval.number, renamed on every rotation */
+	LAYOUTFIXED	/* SNAPPREFIX.number, never renamed, interval.number links */
+};
+
+/* compression used by rsync */
+enum compress {
+	COMPRESSNONE,
+	COMPRESSZLIB,
+	COMPRESSAUTO	/* resolved from the history before the sync starts */
+};
+
+/* whether rsync sends whole files instead of only the changed blocks */
+enum wholefile {
+	WHOLEFILENO,
+	WHOLEFILEYES,
+	WHOLEFILEAUTO	/* resolved from the history before the sync starts */
+};
+
+/* transfer statistics of one sync as reported by rsync --stats */
+struct xferstats {
+	off_t files;	/* files, directories and links in the location */
+	off_t regfiles;	/* regular files in the location */
+	off_t created;	/* files that were created */
+	off_t deleted;	/* files that were deleted */
+	off_t transferred;	/* regular files that were transferred */
+	off_t size;	/* total size of all files */
+	off_t xfersize;	/* total size of the transferred files */
+	off_t literal;	/* bytes of file data that was not matched */
+	off_t matched;	/* bytes of file data that was matched */
+	off_t sent;	/* bytes sent over the wire */
+	off_t received;	/* bytes received over the wire */
+	time_t elapsed;	/* seconds the sync took, -1 if unknown */
+	int complete;	/* whether every rsync reported its statistics */
+	int compressed;	/* whether the data was compressed */
+};
+
+/* a sync in the history of a location */
+struct histent {
+	time_t duration;	/* seconds the sync took */
+	struct xferstats stats;	/* all zero if unknown */
+};
 
 /* temp key value store */
 struct tmpkv {
@@ -62,15 +136,45 @@ struct endpoint {
 	gid_t gid;	/* local gid */
 	gid_t shared;	/* share backup with this group */
 	int pathfd;	/* fd to local path for relative path reference */
+	dev_t dev;	/* device of the local path */
 	int rotfd;	/* rotator communication pipe */
 	int synfd;	/* syncer communication pipe */
 	int poxfd;	/* postexec communication pipe */
 	pid_t rotpid;	/* rotator process id */
 	pid_t synpid;	/* syncer process id */
 	pid_t poxpid;	/* postexec process id */
+	enum epstate state;	/* progress of this endpoint in the master */
+	int order;	/* position in the config file */
+	time_t overdue;	/* seconds the first snapshot is past its lifetime */
+	time_t expected;	/* mean duration of recent syncs, -1 if unknown */
+	time_t maxruntime;	/* seconds a sync may take, 0 is unlimited */
+	time_t deadline;	/* time at which the running sync is stopped */
+	time_t syncstart;	/* time the syncer was started, 0 if not */
+	int overrun;	/* whether the sync exceeded maxruntime */
+	int failed;	/* whether the current run failed */
+	time_t lastrun;	/* time of the last failed run by a daemon, 0 if none */
+	int rmthreads;	/* number of threads to remove old snapshots with */
+	int rmrate;	/* maximum removals per second, 0 is unlimited */
+	int rmload;	/* pause removal above this load average, 0 is never */
+	int asyncpurge;	/* whether to remove old snapshots in the background */
+	enum layout layout;	/* naming of snapshot directories on disk */
+	int resume;	/* whether to resume an interrupted sync */
+	int prestage;	/* whether to clone the newest snapshot while queued */
+	int prestagethreads;	/* number of threads to prestage with */
+	int linkdests;	/* number of snapshots to pass as link-dest */
+	int sshmux;	/* whether to share one ssh connection per host */
+	const char *sshctl;	/* control socket of the shared connection */
+	enum compress compress;	/* compression used by rsync */
+	int compresslevel;	/* compression level, 0 is the rsync default */
+	enum wholefile wholefile;	/* whether to send whole files */
+	int blocksize;	/* block size of the delta algorithm, 0 is automatic */
+	enum compress xfercompress;	/* compress of the next sync */
+	enum wholefile xferwhole;	/* wholefile of the next sync */
+	struct xferstats stats;	/* of the running sync, zero if unknown */
 	struct snapinterval **snapshots;
 	char *rsyncbin;	/* name of rsync binary */
 	char **rsyncargv;	/* extra arguments to rsync */
+	char **shards;	/* subdirs of rpath that are synced in parallel */
 	int **rsyncexit;	/* extra exit codes to accept */
 	char *postexec;	/* postexec */
 };
@@ -101,6 +205,7 @@ char *humanduration(time_t);
 char *snapdirstr(const char *, int);
 char *getsyncdir(void);
 int reapproc(pid_t);
+int exitcode(pid_t, int);
 char *getepid(const struct endpoint *);
 int isopenfd(int);
 char **addstr(char **, const char *);
@@ -112,8 +217,17 @@ time_t snapshottime(struct snapshot *);
 char *snapshotname(struct snapshot *);
 int opensnapshot(const struct snapshot *);
 struct snapshot *newestsnapshot(struct endpoint *, struct snapshot *);
+int linkdestsnapshots(struct endpoint *, struct snapshot *, int);
 int setsnapshot(struct endpoint *, char *, int, struct snapshot *);
 time_t snapshotttl(struct snapshot *, time_t, time_t *);
+time_t bornttl(struct snapshot *, time_t, time_t, time_t *);
+int snapshotdue(struct endpoint *, time_t, time_t *, time_t *);
+int parseduration(const char *, time_t *);
+int parsetimeofday(const char *, int *);
+int readhistory(int, struct histent *);
+int writehistory(int, const struct histent *, int, const struct histent *);
+int writestats(int, const struct xferstats *);
+int readstats(int, struct xferstats *);
 int privdrop(uid_t, gid_t);
 void postexec(const struct endpoint *);
 